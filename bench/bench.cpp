@@ -0,0 +1,200 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Measures the backend's common operations against a PostgreSQL database, and prints one JSON
+// object per benchmark, per line.  Normally run by run_bench.sh, which provides a throwaway
+// database.
+//
+// Usage: quince-postgresql-bench host user password db_name port [scale [threads]]
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <quince/quince.h>
+#include <quince_postgresql/database.h>
+#include <quince_postgresql/detail/statement_tracing.h>
+
+using boost::posix_time::ptime;
+using quince::serial;
+using quince_postgresql::latency_histogram;
+using std::string;
+using std::vector;
+
+struct plain_row {
+    int64_t key;
+    string name;
+    double value;
+};
+QUINCE_MAP_CLASS(plain_row, (key)(name)(value))
+
+struct serial_row {
+    serial id;
+    string name;
+    double value;
+};
+QUINCE_MAP_CLASS(serial_row, (id)(name)(value))
+
+struct wide_row {
+    int64_t key;
+    vector<uint8_t> payload;
+};
+QUINCE_MAP_CLASS(wide_row, (key)(payload))
+
+struct timestamp_row {
+    int64_t key;
+    ptime created;
+    ptime modified;
+    ptime accessed;
+    ptime expires;
+};
+QUINCE_MAP_CLASS(timestamp_row, (key)(created)(modified)(accessed)(expires))
+
+
+namespace {
+    typedef std::chrono::steady_clock clock_type;
+
+    // Time n_ops calls of op, and print the results.  Each op does ops_per_call operations
+    // (e.g. rows scanned), for the purposes of the throughput figure.
+    //
+    void
+    measure(const string &name, uint64_t n_calls, uint64_t ops_per_call, const std::function<void(uint64_t)> &op) {
+        latency_histogram latencies;
+        const clock_type::time_point start = clock_type::now();
+        for (uint64_t i = 0; i < n_calls; i++) {
+            const clock_type::time_point before = clock_type::now();
+            op(i);
+            latencies.record(clock_type::now() - before);
+        }
+        const double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+        const uint64_t n_ops = n_calls * ops_per_call;
+
+        std::cout
+            << "{\"benchmark\": \"" << name << "\""
+            << ", \"calls\": " << n_calls
+            << ", \"ops\": " << n_ops
+            << ", \"seconds\": " << seconds
+            << ", \"ops_per_sec\": " << (seconds > 0 ? n_ops / seconds : 0)
+            << ", \"p50_us\": " << latencies.percentile(0.5).count()
+            << ", \"p99_us\": " << latencies.percentile(0.99).count()
+            << ", \"max_us\": " << latencies.max().count()
+            << "}" << std::endl;
+    }
+
+    template<typename Table>
+    void
+    recreate(Table &table) {
+        table.drop_if_exists();
+        table.open();
+    }
+
+    // Run n_threads threads against db at once, each with its own session, doing n_rounds
+    // rounds of: open a table object of its own (so the shared schema and column caches are
+    // exercised too), and do n_lookups point selects through it.  There's one call, timing the
+    // whole run, so only the throughput is of much interest.
+    //
+    void
+    stress(const quince_postgresql::database &db, unsigned n_threads, uint64_t n_rounds, uint64_t n_lookups, uint64_t n_rows) {
+        const string name = "stress_" + std::to_string(n_threads) + "_threads";
+        measure(name, 1, n_threads * n_rounds * n_lookups, [&](uint64_t) {
+            std::atomic<bool> failed(false);
+            vector<std::thread> threads;
+            for (unsigned t = 0; t < n_threads; t++)
+                threads.emplace_back([&, t] {
+                    try {
+                        for (uint64_t round = 0; round < n_rounds; round++) {
+                            quince::table<plain_row> plain(db, "bench_plain", &plain_row::key);
+                            plain.open();
+                            for (uint64_t i = 0; i < n_lookups; i++) {
+                                const int64_t key = static_cast<int64_t>(((t*n_lookups + i) * 7919) % n_rows);
+                                if (! plain.find(key))  failed = true;
+                            }
+                        }
+                    }
+                    catch (...) {
+                        failed = true;
+                    }
+                });
+            for (std::thread &thread: threads)  thread.join();
+            if (failed)  abort();
+        });
+    }
+
+    template<typename Table>
+    void
+    scan(const string &name, const Table &table, uint64_t n_rows, uint32_t fetch_size, uint64_t n_scans) {
+        measure(name, n_scans, n_rows, [&](uint64_t) {
+            uint64_t n_seen = 0;
+            for (const auto &r: table.fetch_size(fetch_size)) {
+                (void) r;
+                n_seen++;
+            }
+            if (n_seen != n_rows)  abort();
+        });
+    }
+}
+
+int
+main(int argc, char **argv) {
+    if (argc < 6) {
+        std::cerr << "usage: " << argv[0] << " host user password db_name port [scale [threads]]" << std::endl;
+        return 2;
+    }
+    const uint64_t scale = argc > 6  ?  strtoull(argv[6], nullptr, 10)  :  1;
+    const uint64_t n_rows = 10000 * scale;
+    const unsigned n_threads = argc > 7
+        ?  static_cast<unsigned>(strtoul(argv[7], nullptr, 10))
+        :  std::max(std::thread::hardware_concurrency(), 2u);
+
+    const quince_postgresql::database db(argv[1], argv[2], argv[3], argv[4], "", argv[5]);
+
+    quince::table<plain_row> plain(db, "bench_plain", &plain_row::key);
+    recreate(plain);
+    measure("insert", n_rows, 1, [&](uint64_t i) {
+        plain.insert(plain_row{ static_cast<int64_t>(i), "row " + std::to_string(i), i * 0.5 });
+    });
+
+    quince::serial_table<serial_row> serials(db, "bench_serial", &serial_row::id);
+    recreate(serials);
+    measure("insert_with_readback", n_rows, 1, [&](uint64_t i) {
+        serials.insert(serial_row{ serial(), "row " + std::to_string(i), i * 0.5 });
+    });
+
+    measure("point_select", n_rows, 1, [&](uint64_t i) {
+        const int64_t key = static_cast<int64_t>((i * 7919) % n_rows);
+        if (! plain.find(key))  abort();
+    });
+
+    stress(db, n_threads, 10, n_rows / 100, n_rows);
+
+    for (const uint32_t fetch_size: { 10, 100, 1000, 10000 })
+        scan("scan_fetch_" + std::to_string(fetch_size), plain, n_rows, fetch_size, 5);
+
+    const uint64_t n_wide = 100 * scale;
+    quince::table<wide_row> wides(db, "bench_wide", &wide_row::key);
+    recreate(wides);
+    measure("insert_wide_bytea", n_wide, 1, [&](uint64_t i) {
+        wides.insert(wide_row{ static_cast<int64_t>(i), vector<uint8_t>(64*1024, static_cast<uint8_t>(i)) });
+    });
+    scan("scan_wide_bytea", wides, n_wide, 100, 5);
+
+    const ptime epoch(boost::gregorian::date(2015, 1, 1));
+    quince::table<timestamp_row> timestamps(db, "bench_timestamp", &timestamp_row::key);
+    recreate(timestamps);
+    measure("insert_timestamps", n_rows, 1, [&](uint64_t i) {
+        const ptime t = epoch + boost::posix_time::seconds(static_cast<long>(i));
+        timestamps.insert(timestamp_row{ static_cast<int64_t>(i), t, t, t, t });
+    });
+    scan("scan_timestamps", timestamps, n_rows, 1000, 5);
+
+    return 0;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+#          Copyright Michael Shepanski 2014.
+# Distributed under the Boost Software License, Version 1.0.
+#    (See accompanying file ../LICENSE_1_0.txt or copy at
+#          http://www.boost.org/LICENSE_1_0.txt)
+#
+# Run the benchmark program, or the test program (the first argument), against a throwaway
+# PostgreSQL server, initialized in a temporary directory and removed afterwards.  Further
+# arguments are passed to the program (for the benchmarks: the scale, and the number of threads
+# for the stress benchmark).  The server's binaries (initdb, pg_ctl) must be on the PATH, or in
+# $PG_BIN.
+#
+# Usage: run_bench.sh path/to/quince-postgresql-bench [scale [threads]]
+#        run_bench.sh path/to/quince-postgresql-test
+
+set -e
+
+bench="$1"
+shift
+
+[ -n "$PG_BIN" ] && PATH="$PG_BIN:$PATH"
+port="${BENCH_PG_PORT:-54329}"
+user=bench
+password=bench
+data_dir="$(mktemp -d "${TMPDIR:-/tmp}/quince-postgresql-bench.XXXXXX")"
+
+cleanup() {
+    pg_ctl -D "$data_dir/data" -m immediate stop >/dev/null 2>&1 || true
+    rm -rf "$data_dir"
+}
+trap cleanup EXIT INT TERM
+
+echo "$password" > "$data_dir/pwfile"
+initdb -D "$data_dir/data" -U "$user" --pwfile="$data_dir/pwfile" -A md5 >/dev/null
+pg_ctl -D "$data_dir/data" -l "$data_dir/log" -w \
+    -o "-p $port -k $data_dir -c listen_addresses=127.0.0.1 -c fsync=off" start >/dev/null
+
+"$bench" 127.0.0.1 "$user" "$password" postgres "$port" "$@"
@@ -0,0 +1,119 @@
+#ifndef QUINCE_POSTGRESQL__async_executor_h
+#define QUINCE_POSTGRESQL__async_executor_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <quince/detail/row.h>
+#include <quince/detail/sql.h>
+#include <quince/mappers/detail/abstract_mapper.h>
+
+
+namespace quince_postgresql {
+
+class database;
+class session_impl;
+
+// Executes statements without blocking the threads that submit them.  One thread of the
+// executor's own drives up to max_sessions sessions (taken from the database's connection pool
+// as they are needed), waiting on all their sockets at once, so it can keep that many statements
+// in progress concurrently.  Further statements wait in a queue.
+//
+// Each statement runs in a transaction of its own.  Statements that the session hasn't already
+// prepared are sent unprepared, since preparing would cost a round trip of its own.
+//
+// The destructor waits for all submitted statements to finish.
+//
+class async_executor : private boost::noncopyable {
+public:
+    typedef std::vector<std::unique_ptr<quince::row>> output;
+
+    // Called on the executor's thread, with cmd's output, or else with the exception that it
+    // caused (in which case the output is empty).  It should not block.
+    //
+    typedef std::function<void(output &, std::exception_ptr)> completion;
+
+    async_executor(const database &, size_t max_sessions);
+    ~async_executor();
+
+    void submit(std::unique_ptr<quince::sql> cmd, const completion &);
+
+    // For a statement with no output.
+    //
+    std::future<void> execute(std::unique_ptr<quince::sql> cmd);
+
+    // For a statement whose output is mapped to Values by mapper, which must outlive the statement.
+    //
+    template<typename Value>
+    std::future<std::vector<Value>>
+    execute(std::unique_ptr<quince::sql> cmd, const quince::abstract_mapper<Value> &mapper) {
+        const auto promise = std::make_shared<std::promise<std::vector<Value>>>();
+        std::future<std::vector<Value>> result = promise->get_future();
+        submit(std::move(cmd), [promise, &mapper](output &rows, std::exception_ptr error) {
+            if (error) {
+                promise->set_exception(error);
+                return;
+            }
+            try {
+                std::vector<Value> values(rows.size());
+                for (size_t i = 0; i < rows.size(); i++)
+                    mapper.from_row(*rows[i], values[i]);
+                promise->set_value(std::move(values));
+            }
+            catch (...) {
+                promise->set_exception(std::current_exception());
+            }
+        });
+        return result;
+    }
+
+private:
+    struct job {
+        std::unique_ptr<quince::sql> _cmd;
+        completion _completion;
+    };
+
+    struct slot {
+        std::shared_ptr<session_impl> _session;
+        std::unique_ptr<job> _job;
+        output _output;
+        bool _flushing;
+    };
+
+    class waker;
+
+    void run();
+
+    // Returns false when the executor is stopping and has nothing left to do.
+    //
+    bool assign_jobs();
+
+    void start(slot &);
+    void progress(slot &, bool readable, bool writable);
+    static void finish(slot &, std::exception_ptr);
+
+    const database &_database;
+    const size_t _max_sessions;
+    const std::unique_ptr<waker> _waker;
+    std::mutex _mutex;
+    std::deque<std::unique_ptr<job>> _queue;
+    bool _stopping;
+    std::vector<slot> _slots;   // used only by _thread
+    std::thread _thread;
+};
+
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef QUINCE_POSTGRESQL__column_batch_h
+#define QUINCE_POSTGRESQL__column_batch_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <libpq-fe.h>
+#include <quince/detail/column_type.h>
+
+
+namespace quince_postgresql {
+
+// The values of one column of a column_batch, in contiguous storage.  Which of the value
+// vectors is filled depends on the column's type.
+//
+class column_buffer {
+public:
+    column_buffer();
+
+    const std::string &name() const                 { return _name; }
+    quince::column_type type() const                { return _type; }
+    size_t size() const                             { return _size; }
+
+    // Bit i%64 of word i/64 is set if row i is null.
+    //
+    const std::vector<uint64_t> &null_bitmap() const    { return _null_bitmap; }
+    bool is_null(size_t row) const                      { return (_null_bitmap[row/64] >> (row%64)) & 1; }
+
+    // For boolean, small_int, integer, big_int and timestamp columns, the values widened to
+    // int64_t.  Timestamps are microseconds since 2000-01-01 00:00:00.  Nulls are 0.
+    //
+    const std::vector<int64_t> &integers() const    { return _integers; }
+
+    // For floating_point and double_precision columns.  Nulls are 0.
+    //
+    const std::vector<double> &reals() const        { return _reals; }
+
+    // For string and byte_vector columns: row i's value is the bytes of data() from offsets()[i]
+    // up to offsets()[i+1].  Nulls are empty.
+    //
+    const std::vector<uint64_t> &offsets() const    { return _offsets; }
+    const std::string &data() const                 { return _data; }
+
+private:
+    friend class column_batch;
+
+    void assign(const PGresult *, int column);
+
+    std::string _name;
+    quince::column_type _type;
+    size_t _size;
+    std::vector<uint64_t> _null_bitmap;
+    std::vector<int64_t> _integers;
+    std::vector<double> _reals;
+    std::vector<uint64_t> _offsets;
+    std::string _data;
+};
+
+// A batch of query output, decoded column by column, straight from PostgreSQL's binary format,
+// without building a row per row.  See database::exec_with_columnar_output().
+//
+class column_batch {
+public:
+    column_batch();
+
+    size_t n_rows() const                               { return _n_rows; }
+    const std::vector<column_buffer> &columns() const   { return _columns; }
+
+    // Throws malformed_results_exception if there's no such column.
+    //
+    const column_buffer &column(const std::string &name) const;
+
+    // Replace the contents with pg_result's, which must be in binary format, reusing storage
+    // where possible.
+    //
+    void assign(const PGresult *pg_result);
+
+private:
+    size_t _n_rows;
+    std::vector<column_buffer> _columns;
+};
+
+}
+
+#endif
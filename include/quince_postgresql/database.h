@@ -6,10 +6,22 @@
 //    (See accompanying file ../../LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <unordered_map>
 #include <boost/optional.hpp>
 #include <quince/database.h>
+#include <quince/exceptions.h>
 #include <quince/mapping_customization.h>
+#include <quince/mappers/serial_mapper.h>
+#include <quince_postgresql/column_batch.h>
+#include <quince_postgresql/detail/connection_pool.h>
+#include <quince_postgresql/detail/replica_set.h>
 #include <quince_postgresql/detail/session.h>
+#include <quince_postgresql/record_decoder.h>
+#include <quince_postgresql/statement_trace.h>
 
 
 namespace quince_postgresql {
@@ -17,8 +29,55 @@ namespace quince_postgresql {
 class table_base;
 class dialect_sql;
 
+// Thrown by database::bulk_insert() when a batch fails.  Batches before it were loaded
+// successfully (and, outside a transaction, committed).
+//
+struct bulk_insert_exception : quince::dbms_exception {
+    bulk_insert_exception(const std::string &message, size_t batch_index, uint64_t rows_loaded) :
+        quince::dbms_exception(message),
+        _batch_index(batch_index),
+        _rows_loaded(rows_loaded)
+    {}
+
+    const size_t _batch_index;
+    const uint64_t _rows_loaded;
+};
+
+// Thrown when a statement is cancelled because it ran past its deadline, or the statement
+// timeout.  The session remains usable, but any transaction it was in is aborted.
+//
+struct statement_timeout_exception : quince::dbms_exception {
+    explicit statement_timeout_exception(const std::string &message) :
+        quince::dbms_exception(message)
+    {}
+};
+
+// Thrown by pipeline's constructor when there's no transaction open.
+//
+struct no_transaction_exception : quince::exception {
+    no_transaction_exception() :
+        quince::exception("a pipeline can only be opened inside a transaction")
+    {}
+};
+
+// What upsert() and bulk_upsert() do with a value that conflicts with an existing row.
+//
+enum class conflict_action {
+    update,     // overwrite the existing row's other columns with the value's
+    ignore      // leave the existing row as it is, and discard the value
+};
+
 // See http://quince-lib.com/quince_postgresql.html#quince_postgresql.constructor
 //
+// Any number of threads may use one database at once, each with its own sessions.  The set_...()
+// and configure_...() functions, and add_replica(), are the exception: call them before the
+// database is shared.
+//
+// A session may be released after the database is destroyed: its connection is then just
+// closed, and its current stream dropped without further ado.  But no thread may still be
+// using a session, or reading one of its streams, while the database is being destroyed,
+// nor use them afterwards.
+//
 class database : public quince::database {
 public:
     database(
@@ -34,6 +93,246 @@ public:
 
     virtual ~database();
 
+    // Each session keeps up to this many prepared statements on the server, recycling them
+    // whenever it generates the same SQL text again.  0 disables the use of prepared statements.
+    // Affects only sessions created after the call.
+    //
+    void set_statement_cache_capacity(size_t capacity)  { _spec._statement_cache_capacity = capacity; }
+
+    // While a query's output is being consumed, up to this many further batches are requested
+    // ahead of need, so that the DBMS and the network work on them in the meantime.  Depths
+    // above 1 rely on libpq's pipeline mode.  0 disables prefetching.  Affects only sessions
+    // created after the call.
+    //
+    void set_stream_prefetch_depth(uint32_t depth)      { _spec._stream_prefetch_depth = depth; }
+
+    // If non-zero, the number of rows fetched per batch is no longer fixed at the fetch size that
+    // quince requests.  It starts there, then adapts to the observed row width and batch latency,
+    // while keeping the batches that a stream holds at once within about this many bytes.
+    // Affects only sessions created after the call.
+    //
+    void set_stream_memory_budget(size_t bytes)         { _spec._stream_memory_budget = bytes; }
+
+    // See the comment on stream_mode.  The default is stream_mode::cursor.  Affects only
+    // sessions created after the call.
+    //
+    void set_stream_mode(stream_mode mode)  { _spec._stream_mode = mode; }
+
+    // Cancel any statement that takes longer than this.  0 means no limit.  See also
+    // deadline_scope.  Affects only sessions created after the call.
+    //
+    void set_statement_timeout(std::chrono::milliseconds timeout)  { _spec._statement_timeout = timeout; }
+
+    // Call observer (on the thread that executed it) after each statement that any session
+    // executes, with details of where the time went.  An empty observer stops the calls.
+    //
+    void set_statement_observer(const statement_observer &observer)  { _spec._tracing->set_observer(observer); }
+
+    // Keep a histogram of the latencies of each distinct statement text (so parameter values
+    // don't matter), for latency_histograms_snapshot() to describe.
+    //
+    void enable_latency_histograms(bool enabled)    { _spec._tracing->set_histograms_enabled(enabled); }
+    std::string latency_histograms_snapshot() const { return _spec._tracing->histograms_snapshot(); }
+    void clear_latency_histograms()                 { _spec._tracing->clear_histograms(); }
+
+    // Connections are kept in a pool, and sessions that quince has finished with go back
+    // there for reuse.  The pool always holds at least min_size connections (opened in parallel,
+    // on first demand or by prewarm_connections()), and never more than max_size: if that many
+    // are in use then the next session waits for one to be returned.  Connections surplus to
+    // min_size are closed when they have been idle for idle_timeout.
+    //
+    void configure_connection_pool(size_t min_size, size_t max_size, std::chrono::seconds idle_timeout);
+
+    // Add a standby server (e.g. a streaming replica), with the same user, password and
+    // database name as the primary, and the other settings made so far.  Then queries that
+    // only read, and are not in a transaction, go to a standby chosen according to the
+    // replica_policy, or else, if none is suitable, to the primary.  A standby whose connection
+    // fails is left alone for a while.
+    //
+    // A read may not see the session's own earlier writes outside transactions, if the standby
+    // is behind.  Use a transaction, or replica_policy::lag_aware, where that matters.
+    //
+    // A SELECT that locks rows (FOR UPDATE, FOR SHARE, etc.) always goes to the primary.  One
+    // that writes through a function it calls fails on the standby, and is then run on the
+    // primary instead.  That can't be done for a streamed query, whose error shows up only
+    // once its rows are read, so such a query must go in a transaction.
+    //
+    void add_replica(const std::string &host, const std::string &port = "");
+
+    // The default is replica_policy::round_robin.  max_lag matters only to replica_policy::lag_aware.
+    //
+    void set_replica_policy(replica_policy policy, std::chrono::milliseconds max_lag = std::chrono::seconds(1));
+    void prewarm_connections() const;
+
+    // Execute select_text, a SELECT statement, and pass its output to consume() one
+    // column_batch at a time, decoded column by column rather than row by row: in batches of
+    // about fetch_size rows through a cursor or, if fetch_size is 0, all in one batch.  The
+    // same column_batch is reused for every call, so consume() must copy anything it keeps.
+    //
+    void exec_with_columnar_output(
+        const std::string &select_text,
+        uint32_t fetch_size,
+        const std::function<void(const column_batch &)> &consume
+    ) const;
+
+    // Execute select_text, with params bound to $1, $2, etc., and decode the first row of its
+    // output (if any) through decoder.  This bypasses quince's rows and mappers, so it suits
+    // frequent lookups of records whose layout is known at compile time.  Each param's type
+    // must have a field_codec.  A std::vector param is bound as a single array, so e.g.
+    // "... WHERE id = ANY($1)" has the same text, and prepared statement, for any number of ids.
+    //
+    template<typename Record, typename... Fields, typename... Params>
+    boost::optional<Record>
+    fetch_one(
+        const record_decoder<Record, Fields...> &decoder,
+        const std::string &select_text,
+        const Params &... params
+    ) const {
+        boost::optional<Record> result;
+        exec_with_result_output(
+            select_text,
+            { field_codec<Params>::to_cell(params)... },
+            { field_codec<Params>::type_oid()... },
+            [&](const PGresult *pg_result) {
+                if (PQntuples(pg_result) == 0)  return;
+                result = Record();
+                if (decoder.matches(pg_result))
+                    decoder.decode_exact(pg_result, 0, *result);
+                else
+                    decoder.decode_converting(pg_result, 0, *result);
+            }
+        );
+        return result;
+    }
+
+    // As fetch_one(), but decodes all the rows.
+    //
+    template<typename Record, typename... Fields, typename... Params>
+    std::vector<Record>
+    fetch_all(
+        const record_decoder<Record, Fields...> &decoder,
+        const std::string &select_text,
+        const Params &... params
+    ) const {
+        std::vector<Record> result;
+        exec_with_result_output(
+            select_text,
+            { field_codec<Params>::to_cell(params)... },
+            { field_codec<Params>::type_oid()... },
+            [&](const PGresult *pg_result) {
+                const int n_rows = PQntuples(pg_result);
+                result.resize(static_cast<size_t>(n_rows));
+                if (decoder.matches(pg_result))
+                    for (int i = 0; i < n_rows; i++)  decoder.decode_exact(pg_result, i, result[i]);
+                else
+                    for (int i = 0; i < n_rows; i++)  decoder.decode_converting(pg_result, i, result[i]);
+            }
+        );
+        return result;
+    }
+
+    // Insert the values in [begin, end) into table, streaming them in PostgreSQL's binary COPY
+    // format.  Each batch of up to batch_size values is a separate COPY command, and memory use
+    // is bounded by sending the data in chunks as it is encoded.  Returns the number of rows
+    // inserted.
+    //
+    template<typename Table, typename InputIterator>
+    uint64_t
+    bulk_insert(const Table &table, InputIterator begin, InputIterator end, size_t batch_size = 100000) const {
+        const auto &mapper = table.get_value_mapper();
+        return bulk_insert_rows(
+            table.get_binomen(),
+            mapper,
+            [&](quince::row &dest) {
+                if (begin == end)  return false;
+                mapper.to_row(*begin++, dest);
+                return true;
+            },
+            batch_size
+        );
+    }
+
+    // Insert the values in [begin, end) into table, whose generated key is read back through
+    // readback_mapper (the mapper that an ordinary insert into the same table would use), and
+    // return the generated serials in the order of the values.  Each batch of up to batch_size
+    // values is a single INSERT ... RETURNING, with one array parameter per column, so it costs
+    // one round trip, and its text is the same whatever the batch size.
+    //
+    // The serials are matched to the values by position: this relies on PostgreSQL inserting
+    // the rows of INSERT ... SELECT * FROM unnest(...) in the arrays' order, and returning them
+    // in that order, which it does, though SQL doesn't promise it.  (RETURNING can only return
+    // the table's own columns, so there is no ordinal to match them by instead.)  If a trigger
+    // skips rows, so that there are fewer serials than values, malformed_results_exception is
+    // thrown.
+    //
+    template<typename Table, typename InputIterator>
+    std::vector<quince::serial>
+    bulk_insert_with_readback(
+        const Table &table,
+        InputIterator begin,
+        InputIterator end,
+        const quince::serial_mapper &readback_mapper,
+        size_t batch_size = 1000
+    ) const {
+        const auto &mapper = table.get_value_mapper();
+        return insert_rows_with_readback(
+            table.get_binomen(),
+            mapper,
+            [&](quince::row &dest) {
+                if (begin == end)  return false;
+                mapper.to_row(*begin++, dest);
+                return true;
+            },
+            readback_mapper,
+            batch_size
+        );
+    }
+
+    // Insert value into table or, if it has the same values as an existing row for the columns
+    // of conflict_target, deal with it according to action, all in a single statement.
+    // conflict_target is a mapper for the columns of a unique index or the primary key, e.g.
+    // table->*&Value::email.
+    //
+    template<typename Table, typename Value>
+    void
+    upsert(
+        const Table &table,
+        const Value &value,
+        const quince::abstract_mapper_base &conflict_target,
+        conflict_action action = conflict_action::update
+    ) const {
+        bulk_upsert(table, &value, &value + 1, conflict_target, action);
+    }
+
+    // As upsert(), for each value in [begin, end).  Each batch of up to batch_size values is
+    // one statement, with one array parameter per column.  A batch must not contain two values
+    // that conflict with each other.  Returns the number of values processed.
+    //
+    template<typename Table, typename InputIterator>
+    uint64_t
+    bulk_upsert(
+        const Table &table,
+        InputIterator begin,
+        InputIterator end,
+        const quince::abstract_mapper_base &conflict_target,
+        conflict_action action = conflict_action::update,
+        size_t batch_size = 1000
+    ) const {
+        const auto &mapper = table.get_value_mapper();
+        return upsert_rows(
+            table.get_binomen(),
+            mapper,
+            [&](quince::row &dest) {
+                if (begin == end)  return false;
+                mapper.to_row(*begin++, dest);
+                return true;
+            },
+            conflict_target,
+            action,
+            batch_size
+        );
+    }
+
 
     // --- Everything from here to end of class is for quince internal use only. ---
 
@@ -54,16 +353,68 @@ public:
     virtual bool imposes_combination_precedence() const override                        { return true; }
 
     std::unique_ptr<dialect_sql> make_dialect_sql() const;
+    std::shared_ptr<session_impl> get_session_impl() const;
+    std::shared_ptr<session_impl> make_session_impl() const;  // not the calling thread's session
+
+    // Called when a session executes DDL, since it may change tables' columns.
+    //
+    void forget_column_titles() const;
 
     void create_schema(const std::string &schema_name) const;
     bool create_schema_if_not_exists(const boost::optional<std::string> &schema_name) const;
 
 private:
-    std::unique_ptr<session_impl> make_schemaless_session() const;
-    std::shared_ptr<session_impl> get_session_impl() const;
+    uint64_t
+    bulk_insert_rows(
+        const quince::binomen &table,
+        const quince::abstract_mapper_base &mapper,
+        const std::function<bool(quince::row &)> &next,
+        size_t batch_size
+    ) const;
 
-    const session_impl::spec _spec;
+    std::vector<quince::serial>
+    insert_rows_with_readback(
+        const quince::binomen &table,
+        const quince::abstract_mapper_base &mapper,
+        const std::function<bool(quince::row &)> &next,
+        const quince::serial_mapper &readback_mapper,
+        size_t batch_size
+    ) const;
+
+    uint64_t
+    upsert_rows(
+        const quince::binomen &table,
+        const quince::abstract_mapper_base &mapper,
+        const std::function<bool(quince::row &)> &next,
+        const quince::abstract_mapper_base &conflict_target,
+        conflict_action,
+        size_t batch_size
+    ) const;
+
+    void
+    exec_with_result_output(
+        const std::string &text,
+        const std::vector<quince::cell> &params,
+        const std::vector<Oid> &param_types,
+        const std::function<void(const PGresult *)> &consume
+    ) const;
+
+    boost::optional<std::vector<std::string>> cached_column_titles(const quince::binomen &table) const;
+
+    session_impl::spec _spec;
+    const std::shared_ptr<replica_set> _replicas;
+    const std::shared_ptr<connection_pool> _pool;
+    mutable std::mutex _named_schemas_mutex;
     mutable std::set<std::string> _named_schemas_known_to_exist;
+
+    // Column titles of every table in each schema that we've looked at (boost::none standing
+    // for the default schema), loaded a schema at a time.  _column_titles_generation counts
+    // calls to forget_column_titles(), so that a load that overlapped one isn't cached.
+    //
+    typedef std::unordered_map<std::string, std::vector<std::string>> schema_column_titles;
+    mutable std::mutex _column_titles_mutex;
+    mutable std::map<boost::optional<std::string>, schema_column_titles> _column_titles;
+    mutable uint64_t _column_titles_generation;
 };
 
 }
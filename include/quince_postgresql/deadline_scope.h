@@ -0,0 +1,39 @@
+#ifndef QUINCE_POSTGRESQL__deadline_scope_h
+#define QUINCE_POSTGRESQL__deadline_scope_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <chrono>
+#include <memory>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+
+
+namespace quince_postgresql {
+
+class database;
+class session_impl;
+
+// While a deadline_scope exists, any statement that the calling thread's session is still
+// executing at the deadline is cancelled, and statement_timeout_exception is thrown.  The
+// session remains usable.
+//
+// Scopes can be nested, in which case the earliest deadline applies.
+//
+class deadline_scope : private boost::noncopyable {
+public:
+    deadline_scope(const database &, std::chrono::steady_clock::time_point deadline);
+    deadline_scope(const database &, std::chrono::steady_clock::duration timeout);
+    ~deadline_scope();
+
+private:
+    const std::shared_ptr<session_impl> _session;
+    boost::optional<std::chrono::steady_clock::time_point> _previous;
+};
+
+}
+
+#endif
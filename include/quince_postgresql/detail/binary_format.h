@@ -0,0 +1,65 @@
+#ifndef QUINCE_POSTGRESQL__detail__binary_format_h
+#define QUINCE_POSTGRESQL__detail__binary_format_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <boost/numeric/conversion/cast.hpp>
+#include <postgres_ext.h>
+#include <quince/detail/cell.h>
+
+
+namespace quince_postgresql {
+
+// Append value to dest in network byte order, as PostgreSQL's binary formats require.
+//
+template<typename T>
+void
+append_big_endian(T value, std::string &dest) {
+    for (int shift = 8*(sizeof(T)-1); shift >= 0; shift -= 8)
+        dest.push_back(static_cast<char>((static_cast<uint64_t>(value) >> shift) & 0xff));
+}
+
+// The inverse of append_big_endian().
+//
+template<typename T>
+T
+read_big_endian(const char *source) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < sizeof(T); i++)
+        bits = (bits << 8) | static_cast<uint8_t>(source[i]);
+    return static_cast<T>(bits);
+}
+
+// Append to dest a one-dimensional array, in PostgreSQL's binary format, whose elements are
+// of the type element_type_oid, with the binary values in elements (null elements being
+// represented by cells of column_type::none).
+//
+inline void
+append_array(Oid element_type_oid, const std::vector<quince::cell> &elements, std::string &dest) {
+    bool has_null = false;
+    for (const quince::cell &e: elements)
+        if (e.type() == quince::column_type::none)  has_null = true;
+
+    append_big_endian<int32_t>(1, dest);                    // number of dimensions
+    append_big_endian<int32_t>(has_null ? 1 : 0, dest);
+    append_big_endian<int32_t>(element_type_oid, dest);
+    append_big_endian(boost::numeric_cast<int32_t>(elements.size()), dest);
+    append_big_endian<int32_t>(1, dest);                    // lower bound
+    for (const quince::cell &e: elements)
+        if (e.type() == quince::column_type::none)
+            append_big_endian<int32_t>(-1, dest);
+        else {
+            append_big_endian(boost::numeric_cast<int32_t>(e.size()), dest);
+            dest.append(static_cast<const char *>(e.data()), e.size());
+        }
+}
+
+}
+
+#endif
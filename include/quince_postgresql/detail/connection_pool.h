@@ -0,0 +1,119 @@
+#ifndef QUINCE_POSTGRESQL__detail__connection_pool_h
+#define QUINCE_POSTGRESQL__detail__connection_pool_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <quince/detail/session.h>
+#include <quince_postgresql/detail/session.h>
+
+
+namespace quince_postgresql {
+
+class database;
+class replica_set;
+
+// The set of connected session_impls that a database hands out.  When a session is finished
+// with, it is reset and kept for reuse, rather than disconnected.
+//
+class connection_pool : public std::enable_shared_from_this<connection_pool>, private boost::noncopyable {
+public:
+    struct settings {
+        size_t _min_size;   // opened in parallel, ahead of demand
+        size_t _max_size;   // when this many are in use, check_out() waits for one to be returned
+        std::chrono::steady_clock::duration _idle_timeout;  // surplus to _min_size and idle this long => closed
+    };
+
+    // A session_impl on loan from the pool.  Its destructor gives the session_impl back.
+    //
+    // If the pool has replicas, then queries that only read, outside of transactions, go to a
+    // session on one of them instead, if it can take them.
+    //
+    class pooled_session : public quince::abstract_session_impl {
+    public:
+        pooled_session(
+            const std::shared_ptr<connection_pool> &,
+            std::unique_ptr<session_impl>,
+            const std::shared_ptr<replica_set> &replicas
+        );
+        virtual ~pooled_session();
+
+        session_impl &impl() const  { return *_impl; }
+
+        virtual bool                            unchecked_exec(const quince::sql &) override;
+        virtual void                            exec(const quince::sql &) override;
+        virtual quince::result_stream           exec_with_stream_output(const quince::sql &, uint32_t fetch_size) override;
+        virtual std::unique_ptr<quince::row>    exec_with_one_output(const quince::sql &) override;
+        virtual std::unique_ptr<quince::row>    next_output(const quince::result_stream &) override;
+
+    private:
+        bool read_from_replica(const quince::sql &cmd, const std::function<void(session_impl &)> &read);
+
+        const std::shared_ptr<connection_pool> _pool;
+        std::unique_ptr<session_impl> _impl;
+        const std::shared_ptr<replica_set> _replicas;
+        std::vector<std::unique_ptr<pooled_session>> _replica_sessions;     // indexed like _replicas, checked out on first use
+    };
+
+    // A pool whose sessions send reads to replicas, if any, as above.
+    //
+    connection_pool(
+        const database &,
+        const session_impl::spec &,
+        const settings &,
+        const std::shared_ptr<replica_set> &replicas = nullptr
+    );
+    ~connection_pool();
+
+    void configure(const settings &);
+
+    std::unique_ptr<pooled_session> check_out();
+
+    // Open enough sessions, in parallel, to bring the pool up to its minimum size.
+    //
+    void prewarm();
+
+    // Called when the database is going away.  Idle sessions are closed, and sessions that are
+    // checked in later are abandoned (see session_impl::abandon()) rather than reset, since
+    // that would involve the database.
+    //
+    void close();
+
+private:
+    struct idle_session {
+        std::unique_ptr<session_impl> _session;
+        std::chrono::steady_clock::time_point _since;
+    };
+
+    void check_in(std::unique_ptr<session_impl>);
+
+    std::vector<std::unique_ptr<session_impl>> open(size_t n);
+
+    void open_into_idle(std::unique_lock<std::mutex> &, size_t n);
+
+    std::vector<std::unique_ptr<session_impl>> take_expired();
+
+    const database &_database;
+    const session_impl::spec &_spec;
+    const std::shared_ptr<replica_set> _replicas;
+    settings _settings;
+    std::mutex _mutex;
+    std::condition_variable _returned;
+    std::deque<idle_session> _idle;     // most recently returned at the back
+    size_t _size;                       // idle, checked out, or being opened
+    bool _closed;
+};
+
+}
+
+#endif
@@ -6,6 +6,9 @@
 //    (See accompanying file ../../../LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 
+#include <map>
+#include <vector>
+#include <postgres_ext.h>
 #include <quince/detail/sql.h>
 
 
@@ -74,11 +77,65 @@ public:
 
     void write_create_schema(const std::string &);
 
+    void write_copy_from_stdin(const quince::binomen &table, const std::vector<std::string> &column_names);
+
+    // INSERT INTO table (columns) SELECT * FROM unnest($1, $2, ...), where each parameter is an
+    // array holding one column's values, so any number of rows is inserted by the same text.
+    //
+    void
+    write_insert_from_arrays(
+        const quince::binomen &table,
+        const std::vector<std::string> &column_names,
+        const std::vector<quince::column_type> &column_types,
+        const std::vector<std::vector<quince::cell>> &columns
+    );
+
+    void write_insert_default_values(const quince::binomen &table);
+
+    // ON CONFLICT (conflict_columns) DO UPDATE SET each of update_columns from the proposed row,
+    // or DO NOTHING if update_columns is empty.
+    //
+    void
+    write_on_conflict(
+        const std::vector<std::string> &conflict_columns,
+        const std::vector<std::string> &update_columns
+    );
+
+    // Select table name, column name and column type OID, for every column of every table and
+    // view in the given schema (or else the current schema), ordered by table and then column.
+    //
+    void write_select_column_catalog(const boost::optional<std::string> &schema_name);
+
+    // Select one float8: how many seconds a standby server is behind its primary, or 0 if it
+    // has replayed everything it has received, or is not a standby.
+    //
+    void write_select_replication_lag();
+
     void write_fetch(const std::string &cursor_name, uint32_t n_rows);
-    void prepend_declare_cursor(const std::string &cursor_name);
+    void prepend_declare_cursor(const std::string &cursor_name, bool with_hold);
     void write_close_cursor(const std::string &cursor_name);
+    void write_close_all_cursors();
+    void write_deallocate(const std::string &statement_name);
+    void write_rollback();
     void write_set_session_characteristics(isolation_level);
 
+    // Write a single placeholder, and attach a single one-dimensional array value, containing
+    // the given elements (null elements are represented by cells of column_type::none).  So the
+    // statement text is the same however many elements there are.
+    //
+    void write_array_parameter(quince::column_type element_type, const std::vector<quince::cell> &elements);
+
+    // Attach value for the next placeholder that has already been written, e.g. as "$1" in
+    // text passed to write().  type_oid is the parameter's type, if that's not the standard
+    // type for value's cell (e.g. an array, whose cell is a byte_vector).
+    //
+    void attach_parameter(const quince::cell &value, Oid type_oid = InvalidOid);
+
+    // Parameter types that differ from the standard type for the parameter's cell, keyed by
+    // parameter index (0-based).
+    //
+    const std::map<size_t, Oid> &parameter_type_overrides() const  { return _parameter_type_overrides; }
+
 private:
     void write_timestamp_select_list_item(const quince::column_mapper &c);
     virtual void attach_value(const quince::cell &) override;
@@ -86,6 +143,7 @@ private:
     virtual std::string next_value_reference(const quince::cell &) override;
 
     uint32_t _next_placeholder_serial;
+    std::map<size_t, Oid> _parameter_type_overrides;
 };
 
 }
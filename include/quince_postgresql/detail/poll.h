@@ -0,0 +1,50 @@
+#ifndef QUINCE_POSTGRESQL__detail__poll_h
+#define QUINCE_POSTGRESQL__detail__poll_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <vector>
+
+#ifdef _WIN32
+    #include <winsock2.h>
+#else
+    #include <poll.h>
+#endif
+
+
+namespace quince_postgresql {
+
+#ifdef _WIN32
+    typedef WSAPOLLFD socket_poll_item;
+#else
+    typedef pollfd socket_poll_item;
+#endif
+
+inline socket_poll_item
+make_socket_poll_item(int socket, bool for_reading, bool for_writing) {
+    socket_poll_item result;
+    result.fd = socket;
+    result.events = (for_reading ? POLLIN : 0) | (for_writing ? POLLOUT : 0);
+    result.revents = 0;
+    return result;
+}
+
+// Wait until at least one of the items' sockets is ready, or timeout_ms milliseconds
+// have passed (-1 means wait indefinitely).  Returns the number of ready items,
+// 0 on timeout, or a negative number on error.
+//
+inline int
+poll_sockets(std::vector<socket_poll_item> &items, int timeout_ms) {
+#ifdef _WIN32
+    return WSAPoll(items.data(), static_cast<ULONG>(items.size()), timeout_ms);
+#else
+    return poll(items.data(), static_cast<nfds_t>(items.size()), timeout_ms);
+#endif
+}
+
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef QUINCE_POSTGRESQL__detail__replica_set_h
+#define QUINCE_POSTGRESQL__detail__replica_set_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#include <quince_postgresql/detail/connection_pool.h>
+#include <quince_postgresql/detail/session.h>
+
+
+namespace quince_postgresql {
+
+class database;
+
+// How a database chooses a standby server for each read that it sends to one.
+//
+enum class replica_policy {
+    round_robin,        // each in turn
+    least_in_flight,    // the one that is running the fewest of this database's statements
+    lag_aware           // as least_in_flight, but only among those that are no more than max_lag
+                        // behind the primary
+};
+
+// A database's standby servers, each with a connection pool of its own.
+//
+// add(), set_policy() and configure() are not synchronized with the reads, so, like the
+// database functions that call them, they must be called before the database is shared.
+//
+class replica_set : private boost::noncopyable {
+public:
+    replica_set(const database &, const connection_pool::settings &);
+    ~replica_set();
+
+    // The replica's sessions are made to spec, and its pool's settings are the latest given to
+    // the constructor or to configure().
+    //
+    void add(const session_impl::spec &);
+
+    void set_policy(replica_policy, std::chrono::milliseconds max_lag);
+
+    void configure(const connection_pool::settings &);
+
+    bool empty() const  { return _replicas.empty(); }
+
+    // Call read() with a session on the replica that the policy chooses.  The session is the
+    // caller's entry for that replica in sessions (indexed like the replicas), which is checked
+    // out if it's null.  Returns false, either without calling read() or because read() failed
+    // with the replica's connection, if the read should go to the primary instead.  Other
+    // exceptions from read() are propagated.
+    //
+    bool
+    try_read(
+        std::vector<std::unique_ptr<connection_pool::pooled_session>> &sessions,
+        const std::function<void(session_impl &)> &read
+    );
+
+    // As connection_pool::close(), for every replica.
+    //
+    void close();
+
+private:
+    typedef std::chrono::steady_clock clock_type;
+
+    struct replica {
+        replica(const database &, const session_impl::spec &, const connection_pool::settings &);
+
+        const session_impl::spec _spec;
+        const std::shared_ptr<connection_pool> _pool;     // refers to _spec
+        std::atomic<uint32_t> _in_flight;           // statements that it's running for us now
+        std::atomic<int64_t> _down_until;           // clock_type ticks; not used before then
+        std::atomic<int64_t> _lag_measured;         // clock_type ticks, or 0 if never
+        std::atomic<int64_t> _lag_us;
+    };
+
+    boost::optional<size_t> choose();
+
+    bool usable(const replica &, int64_t now) const;
+
+    // Measure r's lag through session if the latest measurement is stale, and return true if
+    // the lag is acceptable.
+    //
+    bool lag_acceptable(replica &r, session_impl &session);
+
+    const database &_database;
+    std::vector<std::unique_ptr<replica>> _replicas;
+    connection_pool::settings _pool_settings;
+    replica_policy _policy;
+    std::chrono::microseconds _max_lag;
+    std::atomic<uint64_t> _next;                    // where round-robin goes next
+};
+
+}
+
+#endif
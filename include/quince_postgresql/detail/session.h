@@ -6,23 +6,40 @@
 //    (See accompanying file ../../../LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <boost/noncopyable.hpp>
 #include <boost/optional.hpp>
 #include <libpq-fe.h>
 #include <quince/detail/compiler_specific.h>
 #include <quince/detail/session.h>
+#include <quince_postgresql/detail/statement_tracing.h>
 
 
 namespace quince_postgresql {
 
+class column_batch;
 class database;
 
 enum class isolation_level {
     serializable, repeatable_read, read_committed, read_uncommitted
 };
 
+// How exec_with_stream_output() gets a query's rows: either from a cursor, a batch at a time,
+// or as the server sends them, without a cursor.  A single_row stream saves the DECLARE, FETCH
+// and CLOSE statements and their round trips, but while it is unfinished the session can't do
+// anything else without first reading all its remaining rows into memory.
+//
+enum class stream_mode {
+    cursor, single_row
+};
+
 class session_impl : public quince::abstract_session_impl {
 public:
     struct spec {
@@ -33,11 +50,19 @@ public:
         boost::optional<std::string> _default_schema;
         boost::optional<std::string> _port;
         boost::optional<isolation_level> _isolation;
+        size_t _statement_cache_capacity;  // 0 means don't use prepared statements
+        uint32_t _stream_prefetch_depth;   // 0 means don't FETCH until a batch is needed
+        size_t _stream_memory_budget;      // 0 means FETCH exactly the requested fetch_size
+        std::shared_ptr<statement_tracing> _tracing;    // shared by all the database's sessions
+        std::chrono::milliseconds _statement_timeout;   // 0 means no limit
+        stream_mode _stream_mode;
 
         std::string connection_string() const;
     };
 
-    explicit session_impl(const database &database, const session_impl::spec &spec);
+    // Takes ownership of conn, which should come from connect().
+    //
+    session_impl(const database &database, const session_impl::spec &spec, PGconn *conn);
 
     virtual ~session_impl();
 
@@ -49,42 +74,222 @@ public:
 
     std::vector<std::string> exec_with_metadata_output(const quince::sql &cmd);
 
+    // The column titles, as exec_with_metadata_output() would give them for a select of all
+    // columns, of each table and view in the given schema (or else the current schema), keyed
+    // by table name.  Tables with columns of types that quince doesn't recognize are left out.
+    //
+    std::unordered_map<std::string, std::vector<std::string>>
+    retrieve_schema_column_titles(const boost::optional<std::string> &schema_name);
+
+    // For commands, such as INSERT ... RETURNING, whose output can't be read through a cursor.
+    // All the output is retrieved in one round trip.
+    //
+    std::vector<std::unique_ptr<quince::row>> exec_with_all_output(const quince::sql &cmd);
+
+    // Execute cmd, and pass its output, in binary format, to consume(), all at once.
+    //
+    void exec_with_result_output(const quince::sql &cmd, const std::function<void(const PGresult *)> &consume);
+
+    // Execute cmd, and pass its output to consume() one column_batch at a time: through a
+    // cursor, in batches of about fetch_size rows, or, if fetch_size is 0, all in one batch.
+    // The same column_batch is reused for every call.
+    //
+    void exec_with_columnar_output(
+        const quince::sql &cmd,
+        uint32_t fetch_size,
+        const std::function<void(const column_batch &)> &consume
+    );
+
+    // Execute cmd, which must be a COPY ... FROM STDIN, and then repeatedly call produce() to
+    // obtain the data, until it returns false.  Each call appends a chunk of data to its
+    // (initially empty) argument, and the chunk is sent before the next call.
+    //
+    void copy_in(const quince::sql &cmd, const std::function<bool(std::string &)> &produce);
+
     void ignore_notices();
 
+    // While a pipeline is open, exec() sends its command without waiting for the result, unless
+    // the command ends the transaction or starts or ends a savepoint.  finish_pipeline() collects
+    // the results, closes the pipeline, and throws the first error, if any.  Anything else that
+    // needs a result, and those transaction boundaries, call finish_pipeline() implicitly --
+    // except that a rollback is executed before the error is thrown.  start_pipeline() throws
+    // no_transaction_exception if there's no transaction open.
+    //
+    void start_pipeline();
+    void finish_pipeline();
+
+    // As finish_pipeline(), but any error is either discarded or, if ! discard_errors, thrown by
+    // the next call to the session.
+    //
+    void close_pipeline(bool discard_errors);
+
+    // Non-blocking execution, for async_executor.  After send_async(cmd), call flush_async()
+    // whenever socket() is writable, until it returns true, and receive_async() whenever socket()
+    // is readable, until it returns true.  Then output holds cmd's output, if any.  Errors are
+    // thrown as by exec(), but only once cmd is finished with, so the session is ready for more.
+    //
+    int socket() const;
+    void send_async(const quince::sql &cmd);
+    bool flush_async();
+    bool receive_async(std::vector<std::unique_ptr<quince::row>> &output);
+
+    // Until further notice, statements must finish by deadline (as well as within the statement
+    // timeout), or else they are cancelled, and statement_timeout_exception is thrown.  Returns
+    // the previous deadline.
+    //
+    boost::optional<std::chrono::steady_clock::time_point>
+    set_deadline(const boost::optional<std::chrono::steady_clock::time_point> &deadline);
+
+    boost::optional<std::chrono::steady_clock::time_point> deadline() const;
+
     std::string encoding() const;
 
+    // True if rs came from this session.
+    //
+    bool owns(const quince::result_stream &rs) const;
+
+    // True if there's no transaction open.  False if unsure, e.g. while a command is in progress.
+    //
+    bool outside_transaction() const;
+
+    // True if the connection is still open and idle, as far as can be told without a round trip.
+    //
+    bool is_alive();
+
+    // Finish any pipeline, stream or transaction that was left open, discard any pipeline error
+    // not yet thrown, and close any cursors, so the session can be handed out afresh.  Returns
+    // false if that isn't possible, in which case the session should be discarded.
+    //
+    bool reset_for_reuse();
+
+    // Prepare to be destroyed after the database has gone, by detaching the current stream (if
+    // any) without reading the rest of its results or closing its cursor, since either could
+    // involve the database.  The connection is just closed.
+    //
+    void abandon();
+
+    // Open n connections in parallel.  Any that fail, or aren't open within libpq's
+    // connect_timeout (30 seconds if that isn't set), are left out of the result.
+    //
+    static std::vector<PGconn *> connect(const spec &, size_t n);
+
 private:
+    class stream_impl;
     class result_stream_impl;
+    class single_row_stream_impl;
+    class statement_cache;
+    class trace_reporter;
 
     QUINCE_NORETURN void throw_last_error() const;
+    QUINCE_NORETURN void throw_error(const std::string &dbms_message, const std::string &sql) const;
+
+    void send_to_pipeline(const quince::sql &cmd);
+
+    void collect_pipeline_results();
 
     void check_no_output(PGresult *exec_result);
 
     std::unique_ptr<quince::row> one_output(PGresult *exec_result);
 
+    std::vector<std::unique_ptr<quince::row>> all_output(PGresult *exec_result);
+
     std::vector<std::string> metadata(PGresult *exec_result);
 
     void absorb_pending_results();
 
     PGresult *pq_exec(const quince::sql &cmd);
 
+    // Collect the results of a command sent by pq_send(), as PQexec() would.
+    //
+    PGresult *exec_finish();
+
+    // PQgetResult(), except that if the current statement's deadline passes while we wait,
+    // we ask the server to cancel it.
+    //
+    PGresult *get_result();
+
+    boost::optional<std::chrono::steady_clock::time_point> statement_deadline() const;
+
+    void start_statement();
+
     int pq_send(const quince::sql &cmd);
 
-    quince::result_stream new_result_stream(const std::string &cursor_name, uint32_t fetch_size);
+    const std::string *prepare(const std::string &text, int n_params, const Oid *types);
+
+    // Take statement_name out of the cache, because executing it produced failure, and queue it
+    // for deallocation if it's still on the server.
+    //
+    void forget_statement(const std::string &statement_name, const PGresult *failure);
+
+    // Take every statement out of the cache (e.g. after DDL), and queue them for deallocation.
+    //
+    void forget_all_statements();
+
+    // Deallocate the statements queued by forget_statement(), forget_all_statements() and
+    // prepare() when it makes room in the cache.  Only called when the connection is free for a
+    // command of our own, i.e. not in a pipeline or while an asynchronous command is pending.
+    //
+    void deallocate_unwanted_statements();
+
+    std::string new_cursor_name();
+
+    quince::result_stream exec_with_single_row_output(const quince::sql &cmd, uint32_t fetch_size);
+
+    // Declare a cursor for cmd, and return a stream of its rows.
+    //
+    quince::result_stream exec_with_cursor_output(const quince::sql &cmd, uint32_t fetch_size);
+
+    // declaring_transaction is the _transaction_serial of the transaction that declared a
+    // non-holdable cursor, or boost::none for a cursor declared WITH HOLD.
+    //
+    quince::result_stream new_result_stream(
+        const std::string &cursor_name,
+        uint32_t fetch_size,
+        boost::optional<uint64_t> declaring_transaction
+    );
+
+    void close_cursor(const std::string &cursor_name, boost::optional<uint64_t> declaring_transaction);
+
+    bool in_transaction() const;
+
+    bool in_pipeline() const;
+
+    void note_transaction_status();
 
-    void close_cursor(const std::string &cursor_name);
+    void end_async();
 
-    static PGconn *connect(const spec &);
     static void disconnect(PGconn *);
     static void disable();
 
     const database &_database;
     PGconn * const _conn;
-    std::shared_ptr<result_stream_impl> _asynchronous_stream;
+    std::shared_ptr<stream_impl> _asynchronous_stream;
     std::string _latest_sql;
+    const std::unique_ptr<statement_cache> _statement_cache;
+    std::vector<std::string> _unwanted_statements;  // still prepared on the server, but no longer cached
+    const uint32_t _stream_prefetch_depth;
+    const size_t _stream_memory_budget;
+    const std::shared_ptr<statement_tracing> _tracing;
+    boost::optional<statement_trace> _pending_trace;    // started by pq_exec(), reported once decoded
+    std::chrono::steady_clock::time_point _decode_start;
+    const std::chrono::milliseconds _statement_timeout;
+    const stream_mode _stream_mode;
+    boost::optional<std::chrono::steady_clock::time_point> _deadline;
+    std::chrono::steady_clock::time_point _statement_start;   // of the latest statement sent
+    bool _cancelled;                                            // the latest statement, for taking too long
+    std::vector<std::string> _idle_cursor_names;
+    uint64_t _next_cursor_serial;
+    const PQnoticeReceiver _default_notice_receiver;
+    bool _pipelining;
+    std::vector<std::string> _pipelined_sql;  // sent in the pipeline, results not yet collected
+    boost::optional<std::pair<std::string, std::string>> _deferred_error;  // message and SQL
+    bool _awaiting_async;
+    boost::optional<std::string> _async_error;
+    bool _was_in_transaction;
+    uint64_t _transaction_serial;   // incremented whenever we see a transaction end
 
-    static bool _disabled;
-    static bool _have_registered_disabler;
+    static std::atomic<bool> _disabled;
+    static std::atomic<bool> _have_registered_disabler;
 };
 
 }
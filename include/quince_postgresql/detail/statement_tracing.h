@@ -0,0 +1,93 @@
+#ifndef QUINCE_POSTGRESQL__detail__statement_tracing_h
+#define QUINCE_POSTGRESQL__detail__statement_tracing_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <quince_postgresql/statement_trace.h>
+
+
+namespace quince_postgresql {
+
+// A histogram of durations, with buckets whose widths grow with the durations they hold, so
+// that any recorded duration is known to within 1/8 of its value (or 1 microsecond).
+//
+class latency_histogram {
+public:
+    latency_histogram();
+
+    void record(std::chrono::nanoseconds);
+
+    uint64_t count() const                      { return _count; }
+    std::chrono::microseconds total() const     { return _total; }
+    std::chrono::microseconds max() const       { return _max; }
+
+    // An upper bound of the durations at the given fraction (0 to 1) of the way through the
+    // recorded durations, in order.
+    //
+    std::chrono::microseconds percentile(double fraction) const;
+
+private:
+    static size_t bucket_index(uint64_t microseconds);
+    static uint64_t bucket_upper_bound(size_t index);
+
+    std::vector<uint64_t> _counts;
+    uint64_t _count;
+    std::chrono::microseconds _total;
+    std::chrono::microseconds _max;
+};
+
+// Shared by a database and its sessions: whoever wants to hear about statements, and the
+// latency histograms, one per statement shape.  The sessions ask enabled() before
+// measuring anything, so tracing costs next to nothing while it's off.
+//
+class statement_tracing : private boost::noncopyable {
+public:
+    statement_tracing();
+
+    bool enabled() const  { return _enabled.load(std::memory_order_relaxed); }
+
+    void set_observer(const statement_observer &);
+    void set_histograms_enabled(bool);
+
+    void report(const statement_trace &);
+
+    // One line per statement shape, busiest first.
+    //
+    std::string histograms_snapshot() const;
+
+    void clear_histograms();
+
+private:
+    // The histograms are spread over shards, by SQL text, so that threads reporting different
+    // statements seldom wait for one another.
+    //
+    struct histogram_shard {
+        std::mutex _mutex;
+        std::unordered_map<std::string, latency_histogram> _histograms;  // keyed by SQL text
+    };
+    enum { n_shards = 16 };
+
+    histogram_shard &shard_for(const std::string &sql) const;
+
+    void update_enabled();
+
+    std::mutex _settings_mutex;     // serializes changes to the settings
+    std::atomic<bool> _enabled;
+    std::atomic<bool> _histograms_enabled;
+    std::shared_ptr<const statement_observer> _observer;  // accessed with std::atomic_load()/atomic_store()
+    mutable histogram_shard _shards[n_shards];
+};
+
+}
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef QUINCE_POSTGRESQL__detail__type_oids_h
+#define QUINCE_POSTGRESQL__detail__type_oids_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdlib.h>
+#include <postgres_ext.h>
+#include <quince/exceptions.h>
+#include <quince/detail/column_type.h>
+
+
+#define BOOLOID 16
+#define BYTEAOID 17
+#define INT8OID 20
+#define INT2OID 21
+#define INT4OID 23
+#define TEXTOID 25
+#define OIDOID 26
+#define FLOAT4OID 700
+#define FLOAT8OID 701
+#define VARCHAROID 1043
+#define TIMESTAMPOID 1114
+#define VOIDOID 2278
+#define TSVECTOROID 3614
+#define UNKNOWNOID 705
+
+#define BOOLARRAYOID 1000
+#define BYTEAARRAYOID 1001
+#define INT2ARRAYOID 1005
+#define INT4ARRAYOID 1007
+#define TEXTARRAYOID 1009
+#define INT8ARRAYOID 1016
+#define FLOAT4ARRAYOID 1021
+#define FLOAT8ARRAYOID 1022
+#define TIMESTAMPARRAYOID 1115
+
+
+namespace quince_postgresql {
+
+inline Oid
+standard_type_oid(quince::column_type type) {
+    using quince::column_type;
+    switch (type) {
+        case column_type::boolean:          return BOOLOID;
+        case column_type::small_int:        return INT2OID;
+        case column_type::integer:          return INT4OID;
+        case column_type::big_int:          return INT8OID;
+        case column_type::floating_point:   return FLOAT4OID;
+        case column_type::double_precision: return FLOAT8OID;
+        case column_type::timestamp:        return TIMESTAMPOID;
+        case column_type::string:           return TEXTOID;
+        case column_type::byte_vector:      return BYTEAOID;
+        case column_type::none:             return VOIDOID;
+        default:                            abort();
+    }
+}
+
+inline quince::column_type
+get_column_type(Oid type_oid)  {
+    using quince::column_type;
+    switch (type_oid) {
+        case BOOLOID:       return column_type::boolean;
+        case INT2OID:       return column_type::small_int;
+        case INT4OID:       return column_type::integer;
+        case INT8OID:       return column_type::big_int;
+        case FLOAT4OID:     return column_type::floating_point;
+        case FLOAT8OID:     return column_type::double_precision;
+        case TIMESTAMPOID:  return column_type::timestamp;
+        case TEXTOID:       return column_type::string;
+        case BYTEAOID:      return column_type::byte_vector;
+        case VOIDOID:       return column_type::none;
+        default:            throw quince::retrieved_unrecognized_type_exception(type_oid);
+    }
+}
+
+// The type of a one-dimensional array whose elements are of the given type.
+//
+inline Oid
+array_type_oid(Oid element_type_oid) {
+    switch (element_type_oid) {
+        case BOOLOID:       return BOOLARRAYOID;
+        case BYTEAOID:      return BYTEAARRAYOID;
+        case INT2OID:       return INT2ARRAYOID;
+        case INT4OID:       return INT4ARRAYOID;
+        case INT8OID:       return INT8ARRAYOID;
+        case TEXTOID:       return TEXTARRAYOID;
+        case FLOAT4OID:     return FLOAT4ARRAYOID;
+        case FLOAT8OID:     return FLOAT8ARRAYOID;
+        case TIMESTAMPOID:  return TIMESTAMPARRAYOID;
+        default:            abort();
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef QUINCE_POSTGRESQL__merged_stream_h
+#define QUINCE_POSTGRESQL__merged_stream_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+
+namespace quince_postgresql {
+
+// The output of several producers, each running on a thread of its own, read as one stream.
+// Each producer is given an emit function, which it calls with each of its values in turn,
+// until emit returns false (because the stream is being destroyed) or the producer has no
+// more.  Each producer can get up to buffer_size values ahead of the reader.
+//
+// Without an ordering, values are read in whatever order they arrive.  With one, the producers
+// must each produce their values in that order, and the stream merges them.
+//
+// If a producer throws, then next() rethrows, once it has read the values produced before
+// that.
+//
+template<typename T>
+class merged_stream : private boost::noncopyable {
+public:
+    typedef std::function<bool(T &&)> emitter;
+    typedef std::function<void(const emitter &)> producer;
+    typedef std::function<bool(const T &, const T &)> ordering;
+
+    merged_stream(const std::vector<producer> &producers, size_t buffer_size, const ordering &less = nullptr) :
+        _less(less),
+        _buffer_size(std::max<size_t>(buffer_size, 1)),
+        _sources(producers.size()),
+        _next_source(0),
+        _cancelled(false)
+    {
+        try {
+            for (size_t i = 0; i < producers.size(); i++)
+                _threads.emplace_back(&merged_stream::run, this, i, producers[i]);
+        }
+        catch (...) {
+            stop();
+            throw;
+        }
+    }
+
+    ~merged_stream() {
+        stop();
+    }
+
+    // Move the next value into dest, or return false if there are no more.
+    //
+    bool
+    next(T &dest) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            const int chosen = _less ? choose_in_order() : choose_any();
+            if (chosen == no_more)  return false;
+            if (chosen == wait) {
+                _produced.wait(lock);
+                continue;
+            }
+
+            source &s = _sources[chosen];
+            if (s._buffer.empty()) {
+                // Finished with an exception, and nothing left before it.
+                //
+                const std::exception_ptr failure = s._failure;
+                s._failure = nullptr;
+                std::rethrow_exception(failure);
+            }
+            dest = std::move(s._buffer.front());
+            s._buffer.pop_front();
+            _consumed.notify_all();
+            return true;
+        }
+    }
+
+private:
+    enum { no_more = -1, wait = -2 };
+
+    struct source {
+        source() : _finished(false)  {}
+
+        std::deque<T> _buffer;
+        bool _finished;
+        std::exception_ptr _failure;
+    };
+
+    void
+    run(size_t index, const producer &produce) {
+        source &s = _sources[index];
+        try {
+            produce([&](T &&value) {
+                std::unique_lock<std::mutex> lock(_mutex);
+                while (! _cancelled  &&  s._buffer.size() >= _buffer_size)  _consumed.wait(lock);
+                if (_cancelled)  return false;
+                s._buffer.push_back(std::move(value));
+                _produced.notify_all();
+                return true;
+            });
+        }
+        catch (...) {
+            const std::lock_guard<std::mutex> lock(_mutex);
+            s._failure = std::current_exception();
+        }
+        const std::lock_guard<std::mutex> lock(_mutex);
+        s._finished = true;
+        _produced.notify_all();
+    }
+
+    // Any source with a value (or a failure) to read, taking turns so that none is starved.
+    //
+    int
+    choose_any() {
+        bool all_finished = true;
+        for (size_t i = 0; i < _sources.size(); i++) {
+            const size_t candidate = (_next_source + i) % _sources.size();
+            const source &s = _sources[candidate];
+            if (! s._buffer.empty()  ||  s._failure) {
+                _next_source = candidate + 1;
+                return static_cast<int>(candidate);
+            }
+            if (! s._finished)  all_finished = false;
+        }
+        return all_finished ? no_more : wait;
+    }
+
+    // The source with the least value, which can only be known when every source that isn't
+    // finished has a value to compare.
+    //
+    int
+    choose_in_order() {
+        int result = no_more;
+        for (size_t i = 0; i < _sources.size(); i++) {
+            const source &s = _sources[i];
+            if (s._buffer.empty()) {
+                if (s._failure)         return static_cast<int>(i);
+                if (! s._finished)      return wait;
+            }
+            else if (result == no_more  ||  _less(s._buffer.front(), _sources[result]._buffer.front()))
+                result = static_cast<int>(i);
+        }
+        return result;
+    }
+
+    void
+    stop() {
+        {
+            const std::lock_guard<std::mutex> lock(_mutex);
+            _cancelled = true;
+        }
+        _consumed.notify_all();
+        for (std::thread &t: _threads)
+            if (t.joinable())  t.join();
+    }
+
+    const ordering _less;
+    const size_t _buffer_size;
+    std::mutex _mutex;
+    std::condition_variable _produced;
+    std::condition_variable _consumed;
+    std::vector<source> _sources;
+    size_t _next_source;            // where choose_any() looks first
+    bool _cancelled;
+    std::vector<std::thread> _threads;
+};
+
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef QUINCE_POSTGRESQL__pipeline_h
+#define QUINCE_POSTGRESQL__pipeline_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <memory>
+#include <boost/noncopyable.hpp>
+
+
+namespace quince_postgresql {
+
+class database;
+class session_impl;
+
+// While a pipeline exists, statements that produce no output (e.g. the inserts, updates and
+// deletes of a quince::transaction) are sent to the DBMS on the calling thread's session without
+// waiting for their results, so that many of them share one round trip.
+//
+// A pipeline can only be opened inside a transaction (otherwise no_transaction_exception is
+// thrown), so that a failed statement aborts the whole transaction, rather than silently
+// undoing the statements before it that seemed to succeed.
+//
+// sync() waits for all the results, and throws an exception for the first statement that failed.
+// Anything that needs output of its own (e.g. a query), and the statements that end a transaction
+// or start or end a nested one, do an implicit sync() first.  So the transaction's commit throws,
+// rather than appearing to succeed, if any statement in the pipeline failed.  A rollback is the
+// exception: it is executed first, and then the error is thrown, so that a failure in a nested
+// transaction is undone and the outer transaction can still commit.
+//
+// If the pipeline is destroyed without a sync(), then its results are collected anyway, and
+// any error is thrown by the session's next call (typically the transaction's commit) --
+// unless the pipeline is being destroyed by an exception, in which case errors are discarded.
+//
+class pipeline : private boost::noncopyable {
+public:
+    explicit pipeline(const database &);
+    ~pipeline();
+
+    void sync();
+
+private:
+    const std::shared_ptr<session_impl> _session;
+    bool _open;
+    const int _uncaught_exceptions;     // as at construction
+};
+
+}
+
+#endif
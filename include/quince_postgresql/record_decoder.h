@@ -0,0 +1,370 @@
+#ifndef QUINCE_POSTGRESQL__record_decoder_h
+#define QUINCE_POSTGRESQL__record_decoder_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include <boost/numeric/conversion/cast.hpp>
+#include <boost/optional.hpp>
+#include <libpq-fe.h>
+#include <quince/detail/cell.h>
+#include <quince/exceptions.h>
+#include <quince_postgresql/detail/binary_format.h>
+#include <quince_postgresql/detail/type_oids.h>
+
+
+namespace quince_postgresql {
+
+// How a field of type T is read from, and written to, PostgreSQL's binary format, for
+// record_decoder and the database::fetch_...() functions.  Each specialization provides:
+//
+//  - type_oid(): the PostgreSQL type that T is written as,
+//  - exact(oid): true if a column of that type can be decoded by decode(),
+//  - decode(data, length, dest): the fast path, with no checks,
+//  - convert(oid, data, length, dest): the fallback, for other columns that hold compatible
+//    values (e.g. an integer column read into an int64_t), which throws
+//    malformed_results_exception if they don't,
+//  - to_cell(value): value as a statement parameter.
+//
+template<typename T> struct field_codec;
+
+namespace detail {
+    template<typename T, quince::column_type Type, Oid TypeOid>
+    struct integral_codec {
+        static Oid type_oid()       { return TypeOid; }
+        static bool exact(Oid oid)  { return oid == TypeOid; }
+
+        static void
+        decode(const char *data, int, T &dest) {
+            dest = read_big_endian<T>(data);
+        }
+
+        static void
+        convert(Oid oid, const char *data, int, T &dest) {
+            try {
+                switch (oid) {
+                    case INT2OID:   dest = boost::numeric_cast<T>(read_big_endian<int16_t>(data));  break;
+                    case INT4OID:   dest = boost::numeric_cast<T>(read_big_endian<int32_t>(data));  break;
+                    case INT8OID:   dest = boost::numeric_cast<T>(read_big_endian<int64_t>(data));  break;
+                    default:        throw quince::malformed_results_exception();
+                }
+            }
+            catch (const boost::numeric::bad_numeric_cast &) {
+                // The value doesn't fit in T.
+                //
+                throw quince::malformed_results_exception();
+            }
+        }
+
+        static quince::cell
+        to_cell(T value) {
+            std::string bytes;
+            append_big_endian(value, bytes);
+            return quince::cell(Type, true, bytes.data(), bytes.size());
+        }
+    };
+
+    template<typename T, typename Bits, quince::column_type Type, Oid TypeOid>
+    struct floating_codec {
+        static Oid type_oid()       { return TypeOid; }
+        static bool exact(Oid oid)  { return oid == TypeOid; }
+
+        static void
+        decode(const char *data, int, T &dest) {
+            const Bits bits = read_big_endian<Bits>(data);
+            memcpy(&dest, &bits, sizeof(dest));
+        }
+
+        static void
+        convert(Oid oid, const char *data, int length, T &dest) {
+            if (oid == FLOAT4OID) {
+                float narrow;
+                floating_codec<float, uint32_t, quince::column_type::floating_point, FLOAT4OID>::decode(data, length, narrow);
+                dest = narrow;
+            }
+            else if (exact(oid))
+                decode(data, length, dest);
+            else
+                throw quince::malformed_results_exception();
+        }
+
+        static quince::cell
+        to_cell(T value) {
+            Bits bits;
+            memcpy(&bits, &value, sizeof(bits));
+            std::string bytes;
+            append_big_endian(bits, bytes);
+            return quince::cell(Type, true, bytes.data(), bytes.size());
+        }
+    };
+
+    template<typename T, quince::column_type Type, Oid TypeOid, Oid AlternativeOid>
+    struct bytes_codec {
+        static Oid type_oid()       { return TypeOid; }
+        static bool exact(Oid oid)  { return oid == TypeOid  ||  oid == AlternativeOid; }
+
+        static void
+        decode(const char *data, int length, T &dest) {
+            dest.assign(data, data + length);
+        }
+
+        static void
+        convert(Oid oid, const char *data, int length, T &dest) {
+            if (! exact(oid))  throw quince::malformed_results_exception();
+            decode(data, length, dest);
+        }
+
+        static quince::cell
+        to_cell(const T &value) {
+            return quince::cell(Type, true, value.data(), value.size());
+        }
+    };
+}
+
+template<> struct field_codec<bool> {
+    static Oid type_oid()       { return BOOLOID; }
+    static bool exact(Oid oid)  { return oid == BOOLOID; }
+
+    static void
+    decode(const char *data, int, bool &dest) {
+        dest = *data != 0;
+    }
+
+    static void
+    convert(Oid oid, const char *data, int length, bool &dest) {
+        if (! exact(oid))  throw quince::malformed_results_exception();
+        decode(data, length, dest);
+    }
+
+    static quince::cell
+    to_cell(bool value) {
+        const char byte = value ? 1 : 0;
+        return quince::cell(quince::column_type::boolean, true, &byte, 1);
+    }
+};
+
+template<> struct field_codec<int16_t> :
+    detail::integral_codec<int16_t, quince::column_type::small_int, INT2OID>
+{};
+
+template<> struct field_codec<int32_t> :
+    detail::integral_codec<int32_t, quince::column_type::integer, INT4OID>
+{};
+
+template<> struct field_codec<int64_t> :
+    detail::integral_codec<int64_t, quince::column_type::big_int, INT8OID>
+{};
+
+template<> struct field_codec<float> :
+    detail::floating_codec<float, uint32_t, quince::column_type::floating_point, FLOAT4OID>
+{};
+
+template<> struct field_codec<double> :
+    detail::floating_codec<double, uint64_t, quince::column_type::double_precision, FLOAT8OID>
+{};
+
+template<> struct field_codec<std::string> :
+    detail::bytes_codec<std::string, quince::column_type::string, TEXTOID, VARCHAROID>
+{};
+
+template<> struct field_codec<std::vector<uint8_t>> :
+    detail::bytes_codec<std::vector<uint8_t>, quince::column_type::byte_vector, BYTEAOID, BYTEAOID>
+{};
+
+// A one-dimensional array, without nulls, of any other element type that has a field_codec.
+// As a parameter, it lets one statement take any number of values, with text that stays the
+// same however many there are, e.g.:
+//
+//      db.fetch_all(point_decoder, "SELECT id, x, label FROM points WHERE id = ANY($1)", ids);
+//
+template<typename T> struct field_codec<std::vector<T>> {
+    static Oid type_oid()       { return array_type_oid(field_codec<T>::type_oid()); }
+    static bool exact(Oid oid)  { return oid == type_oid(); }
+
+    static void
+    decode(const char *data, int length, std::vector<T> &dest) {
+        const char *const end = data + length;
+        const auto next_int32 = [&]() {
+            if (end - data < 4)  throw quince::malformed_results_exception();
+            const int32_t result = read_big_endian<int32_t>(data);
+            data += 4;
+            return result;
+        };
+
+        dest.clear();
+        const int32_t n_dimensions = next_int32();
+        next_int32();   // whether there are nulls; we find out as we go
+        const Oid element_type = static_cast<Oid>(next_int32());
+        if (n_dimensions == 0)  return;
+        if (n_dimensions != 1)  throw quince::malformed_results_exception();
+
+        const int32_t n_elements = next_int32();
+        next_int32();   // lower bound
+        if (n_elements < 0)  throw quince::malformed_results_exception();
+
+        const bool exact_elements = field_codec<T>::exact(element_type);
+        dest.resize(static_cast<size_t>(n_elements));
+        for (T &element: dest) {
+            const int32_t element_length = next_int32();
+            if (element_length < 0  ||  end - data < element_length)  throw quince::malformed_results_exception();
+            if (exact_elements)
+                field_codec<T>::decode(data, element_length, element);
+            else
+                field_codec<T>::convert(element_type, data, element_length, element);
+            data += element_length;
+        }
+    }
+
+    static void
+    convert(Oid oid, const char *data, int length, std::vector<T> &dest) {
+        if (! exact(oid))  throw quince::malformed_results_exception();
+        decode(data, length, dest);
+    }
+
+    static quince::cell
+    to_cell(const std::vector<T> &value) {
+        std::vector<quince::cell> elements;
+        elements.reserve(value.size());
+        for (const T &element: value)  elements.push_back(field_codec<T>::to_cell(element));
+
+        std::string array;
+        append_array(field_codec<T>::type_oid(), elements, array);
+        return quince::cell(quince::column_type::byte_vector, true, array.data(), array.size());
+    }
+};
+
+
+// Decodes the rows of a query's result, column i into the i-th member given to the
+// constructor, e.g.:
+//
+//      struct point { int32_t id; double x; std::string label; };
+//      const record_decoder<point, int32_t, double, std::string> point_decoder(&point::id, &point::x, &point::label);
+//
+// A member whose column may be null must be a boost::optional; null into anything else throws
+// malformed_results_exception.
+//
+// Whereas a quince query checks each column's type once per result, builds a cell for each
+// value, and hands the row to mappers through virtual calls, record_decoder checks the whole
+// result against the members' types once, and then, if they match, decodes each value with
+// inline code chosen at compile time.  If they don't match, but are compatible (e.g. an int4
+// column into an int64_t member), each value is converted with a run-time check instead.
+//
+template<typename Record, typename... Fields>
+class record_decoder {
+public:
+    explicit record_decoder(Fields Record::*... members) :
+        _members(members...)
+    {}
+
+    // True if each column of pg_result is exactly of the type that the corresponding member
+    // expects, so that decode_exact() can be used.
+    //
+    bool
+    matches(const PGresult *pg_result) const {
+        if (PQnfields(pg_result) != n_fields)  return false;
+        for (int i = 0; i < n_fields; i++)
+            if (PQfformat(pg_result, i) != 1)  return false;
+        return matches(pg_result, std::integral_constant<int, 0>());
+    }
+
+    // Decode row of pg_result into dest.  Requires matches(pg_result).
+    //
+    void
+    decode_exact(const PGresult *pg_result, int row, Record &dest) const {
+        decode_exact(pg_result, row, dest, std::integral_constant<int, 0>());
+    }
+
+    // Decode row of pg_result into dest, converting compatible types, or throwing
+    // malformed_results_exception.
+    //
+    void
+    decode_converting(const PGresult *pg_result, int row, Record &dest) const {
+        if (PQnfields(pg_result) != n_fields)  throw quince::malformed_results_exception();
+        decode_converting(pg_result, row, dest, std::integral_constant<int, 0>());
+    }
+
+private:
+    static const int n_fields = sizeof...(Fields);
+
+    template<int I>
+    struct field {
+        typedef typename std::tuple_element<I, std::tuple<Fields...>>::type type;
+    };
+
+    template<typename T>
+    struct null_handler {
+        static void set_null(T &)   { throw quince::malformed_results_exception(); }
+        static T &value(T &dest)    { return dest; }
+        typedef T value_type;
+    };
+
+    template<typename T>
+    struct null_handler<boost::optional<T>> {
+        static void set_null(boost::optional<T> &dest)  { dest = boost::none; }
+        static T &value(boost::optional<T> &dest)       { if (! dest)  dest = T();  return *dest; }
+        typedef T value_type;
+    };
+
+    bool matches(const PGresult *, std::integral_constant<int, n_fields>) const  { return true; }
+
+    template<int I>
+    bool
+    matches(const PGresult *pg_result, std::integral_constant<int, I>) const {
+        typedef null_handler<typename field<I>::type> nulls;
+        return field_codec<typename nulls::value_type>::exact(PQftype(pg_result, I))
+            && matches(pg_result, std::integral_constant<int, I+1>());
+    }
+
+    void decode_exact(const PGresult *, int, Record &, std::integral_constant<int, n_fields>) const  {}
+
+    template<int I>
+    void
+    decode_exact(const PGresult *pg_result, int row, Record &dest, std::integral_constant<int, I>) const {
+        typedef null_handler<typename field<I>::type> nulls;
+        typename field<I>::type &member = dest.*std::get<I>(_members);
+        if (PQgetisnull(pg_result, row, I))
+            nulls::set_null(member);
+        else
+            field_codec<typename nulls::value_type>::decode(
+                PQgetvalue(pg_result, row, I),
+                PQgetlength(pg_result, row, I),
+                nulls::value(member)
+            );
+        decode_exact(pg_result, row, dest, std::integral_constant<int, I+1>());
+    }
+
+    void decode_converting(const PGresult *, int, Record &, std::integral_constant<int, n_fields>) const  {}
+
+    template<int I>
+    void
+    decode_converting(const PGresult *pg_result, int row, Record &dest, std::integral_constant<int, I>) const {
+        typedef null_handler<typename field<I>::type> nulls;
+        typename field<I>::type &member = dest.*std::get<I>(_members);
+        if (PQgetisnull(pg_result, row, I))
+            nulls::set_null(member);
+        else {
+            if (PQfformat(pg_result, I) != 1)  throw quince::malformed_results_exception();
+            field_codec<typename nulls::value_type>::convert(
+                PQftype(pg_result, I),
+                PQgetvalue(pg_result, row, I),
+                PQgetlength(pg_result, row, I),
+                nulls::value(member)
+            );
+        }
+        decode_converting(pg_result, row, dest, std::integral_constant<int, I+1>());
+    }
+
+    const std::tuple<Fields Record::*...> _members;
+};
+
+}
+
+#endif
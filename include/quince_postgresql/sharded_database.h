@@ -0,0 +1,98 @@
+#ifndef QUINCE_POSTGRESQL__sharded_database_h
+#define QUINCE_POSTGRESQL__sharded_database_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <quince_postgresql/database.h>
+
+
+namespace quince_postgresql {
+
+// Where to find one shard: the same as the arguments of database's constructor.
+//
+struct shard_spec {
+    std::string _host;
+    std::string _user;
+    std::string _password;
+    std::string _db_name;
+    std::string _default_schema;
+    std::string _port;
+};
+
+// Maps a shard key to 64 bits, the same way on every platform and in every process (which
+// std::hash doesn't promise), since a row's shard must not change.  Specialize it for other
+// key types.
+//
+template<typename Key, typename Enable = void> struct shard_hash;
+
+// The finalizer of SplitMix64, so that consecutive keys are spread over all the shards.
+//
+inline uint64_t
+mix_shard_bits(uint64_t bits) {
+    bits = (bits ^ (bits >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    bits = (bits ^ (bits >> 27)) * 0x94d049bb133111ebULL;
+    return bits ^ (bits >> 31);
+}
+
+template<typename Key>
+struct shard_hash<Key, typename std::enable_if<std::is_integral<Key>::value>::type> {
+    uint64_t operator()(Key key) const  { return mix_shard_bits(static_cast<uint64_t>(key)); }
+};
+
+template<>
+struct shard_hash<std::string> {
+    // FNV-1a
+    //
+    uint64_t
+    operator()(const std::string &key) const {
+        uint64_t result = 0xcbf29ce484222325ULL;
+        for (const char c: key)
+            result = (result ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+        return mix_shard_bits(result);
+    }
+};
+
+// A database for each of several PostgreSQL servers, with a fixed, hash-based assignment of
+// keys to them.  The assignment depends on the number of shards, so adding a shard means
+// moving rows.  See sharded_table.
+//
+class sharded_database : private boost::noncopyable {
+public:
+    explicit sharded_database(const std::vector<shard_spec> &shards);
+    ~sharded_database();
+
+    size_t size() const  { return _shards.size(); }
+
+    // For settings, e.g. shard(i).set_statement_timeout(...).
+    //
+    const database &shard(size_t index) const  { return *_shards[index]; }
+    database &shard(size_t index)              { return *_shards[index]; }
+
+    template<typename Key>
+    size_t
+    shard_index(const Key &key) const {
+        return static_cast<size_t>(shard_hash<Key>()(key) % _shards.size());
+    }
+
+    // Call work(i) for each shard index i, all at once, on threads of their own, and wait for
+    // them all to finish.  Then rethrow the exception from the lowest i that threw, if any.
+    //
+    void for_each_shard(const std::function<void(size_t)> &work) const;
+
+private:
+    std::vector<std::unique_ptr<database>> _shards;
+};
+
+}
+
+#endif
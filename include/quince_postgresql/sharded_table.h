@@ -0,0 +1,98 @@
+#ifndef QUINCE_POSTGRESQL__sharded_table_h
+#define QUINCE_POSTGRESQL__sharded_table_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <quince/table.h>
+#include <quince/detail/util.h>
+#include <quince_postgresql/merged_stream.h>
+#include <quince_postgresql/sharded_database.h>
+
+
+namespace quince_postgresql {
+
+// A table that is split across the shards of a sharded_database, with a quince::table of the
+// same name on each, and each Value stored on the shard that its key (which is also the
+// shard key) hashes to.  So inserts and lookups by key involve just one shard, and other
+// queries are run on all the shards in parallel.
+//
+template<typename Value, typename Key>
+class sharded_table : private boost::noncopyable {
+public:
+    typedef quince::table<Value> shard_table;
+
+    sharded_table(const sharded_database &database, const std::string &name, Key Value::*key) :
+        _database(database),
+        _key(key)
+    {
+        for (size_t i = 0; i < database.size(); i++)
+            _shards.push_back(quince::make_unique<shard_table>(database.shard(i), name, key));
+    }
+
+    size_t size() const                                 { return _shards.size(); }
+    shard_table &shard(size_t index) const              { return *_shards[index]; }
+    shard_table &shard_for(const Key &key) const        { return *_shards[_database.shard_index(key)]; }
+
+    void
+    open() {
+        _database.for_each_shard([&](size_t i) { _shards[i]->open(); });
+    }
+
+    void
+    drop_if_exists() {
+        _database.for_each_shard([&](size_t i) { _shards[i]->drop_if_exists(); });
+    }
+
+    void
+    insert(const Value &value) const {
+        shard_for(value.*_key).insert(value);
+    }
+
+    auto
+    find(const Key &key) const -> decltype(std::declval<shard_table &>().find(key)) {
+        return shard_for(key).find(key);
+    }
+
+    // Call make_query(t) for each shard's table t, to get the query to run there (e.g.
+    // t.where(t->*&Value::score > 10), or just t), run them all in parallel, and stream their
+    // combined output.  Each shard can get up to buffer_size values ahead of the reader.
+    //
+    // If less is given then the output is merged in that order, so each shard's query must
+    // produce its output in that order too (e.g. with an order() whose ordering matches less).
+    // Otherwise values are read in whatever order they arrive.
+    //
+    template<typename MakeQuery>
+    std::unique_ptr<merged_stream<Value>>
+    scan(
+        const MakeQuery &make_query,
+        size_t buffer_size = 1000,
+        const typename merged_stream<Value>::ordering &less = nullptr
+    ) const {
+        std::vector<typename merged_stream<Value>::producer> producers;
+        for (const auto &shard: _shards) {
+            const shard_table *const table = shard.get();
+            producers.push_back([=](const typename merged_stream<Value>::emitter &emit) {
+                for (const Value &v: make_query(*table))
+                    if (! emit(Value(v)))  return;
+            });
+        }
+        return quince::make_unique<merged_stream<Value>>(producers, buffer_size, less);
+    }
+
+private:
+    const sharded_database &_database;
+    Key Value::* const _key;
+    std::vector<std::unique_ptr<shard_table>> _shards;
+};
+
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef QUINCE_POSTGRESQL__statement_trace_h
+#define QUINCE_POSTGRESQL__statement_trace_h
+
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <string>
+
+
+namespace quince_postgresql {
+
+// What database::set_statement_observer() reports about each statement that a session executes.
+//
+struct statement_trace {
+    std::string _sql;                       // with placeholders, not values, so it identifies the statement's shape
+    size_t _n_params;
+    std::chrono::nanoseconds _send_time;    // preparing (if necessary) and sending the statement
+    std::chrono::nanoseconds _wait_time;    // from then until the whole result had arrived
+    std::chrono::nanoseconds _decode_time;  // converting the result to rows (0 for a FETCH, whose rows
+                                            // are converted one at a time, as the stream is read)
+    uint64_t _n_rows;
+    uint64_t _n_bytes;                      // of column data received
+    bool _succeeded;
+};
+
+typedef std::function<void(const statement_trace &)> statement_observer;
+
+}
+
+#endif
@@ -0,0 +1,232 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <assert.h>
+#include <chrono>
+#include <quince/detail/util.h>
+#include <quince_postgresql/async_executor.h>
+#include <quince_postgresql/database.h>
+#include <quince_postgresql/detail/poll.h>
+
+#ifndef _WIN32
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <system_error>
+    #include <unistd.h>
+#endif
+
+using namespace quince;
+using std::lock_guard;
+using std::mutex;
+using std::unique_ptr;
+using std::vector;
+
+
+namespace quince_postgresql {
+
+// Interrupts the executor thread's wait for its sockets, when there is new work.
+//
+#ifdef _WIN32
+
+// Windows can't poll a pipe, so the executor thread just wakes up periodically.
+//
+class async_executor::waker {
+public:
+    void add_to(vector<socket_poll_item> &) const   {}
+    int timeout_ms() const                          { return 10; }
+    void wake()                                     {}
+    void drain()                                    {}
+};
+
+#else
+
+class async_executor::waker {
+public:
+    waker() {
+        if (pipe(_fds) != 0)  throw std::system_error(errno, std::system_category());
+        for (int fd: _fds)  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    ~waker() {
+        close(_fds[0]);
+        close(_fds[1]);
+    }
+
+    void add_to(vector<socket_poll_item> &items) const {
+        items.push_back(make_socket_poll_item(_fds[0], true, false));
+    }
+
+    int timeout_ms() const {
+        return -1;
+    }
+
+    void wake() {
+        const char byte = 0;
+        // If the pipe is full then a wakeup is pending anyway.
+        //
+        if (write(_fds[1], &byte, 1) < 0) {}
+    }
+
+    void drain() {
+        char buffer[64];
+        while (read(_fds[0], buffer, sizeof(buffer)) > 0) {}
+    }
+
+private:
+    int _fds[2];
+};
+
+#endif
+
+
+async_executor::async_executor(const database &database, size_t max_sessions) :
+    _database(database),
+    _max_sessions(max_sessions),
+    _waker(quince::make_unique<waker>()),
+    _stopping(false)
+{
+    assert(max_sessions != 0);
+    _slots.reserve(max_sessions);
+    _thread = std::thread([this] { run(); });
+}
+
+async_executor::~async_executor() {
+    {
+        const lock_guard<mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _waker->wake();
+    _thread.join();
+}
+
+void
+async_executor::submit(unique_ptr<sql> cmd, const completion &completion) {
+    unique_ptr<job> j(new job{ std::move(cmd), completion });
+    {
+        const lock_guard<mutex> lock(_mutex);
+        _queue.push_back(std::move(j));
+    }
+    _waker->wake();
+}
+
+std::future<void>
+async_executor::execute(unique_ptr<sql> cmd) {
+    const auto promise = std::make_shared<std::promise<void>>();
+    std::future<void> result = promise->get_future();
+    submit(std::move(cmd), [promise](output &, std::exception_ptr error) {
+        if (error)
+            promise->set_exception(error);
+        else
+            promise->set_value();
+    });
+    return result;
+}
+
+void
+async_executor::run() {
+    vector<socket_poll_item> items;
+
+    while (assign_jobs()) {
+        items.clear();
+        _waker->add_to(items);
+        const size_t first_slot_item = items.size();
+        for (const slot &s: _slots)
+            if (s._job)  items.push_back(make_socket_poll_item(s._session->socket(), true, s._flushing));
+
+        if (items.empty())
+            std::this_thread::sleep_for(std::chrono::milliseconds(_waker->timeout_ms()));
+        else if (poll_sockets(items, _waker->timeout_ms()) < 0)
+            continue;  // e.g. EINTR
+
+        _waker->drain();
+        size_t item = first_slot_item;
+        for (slot &s: _slots)
+            if (s._job) {
+                const short revents = items[item++].revents;
+                progress(s, (revents & ~POLLOUT) != 0, (revents & POLLOUT) != 0);
+            }
+    }
+}
+
+bool
+async_executor::assign_jobs() {
+    for (;;) {
+        unique_ptr<job> j;
+        slot *idle = nullptr;
+        {
+            const lock_guard<mutex> lock(_mutex);
+            bool any_busy = false;
+            for (slot &s: _slots)
+                if (s._job)     any_busy = true;
+                else if (! idle) idle = &s;
+
+            if (_queue.empty())  return ! (_stopping && ! any_busy);
+            if (! idle  &&  _slots.size() == _max_sessions)  return true;
+
+            j = std::move(_queue.front());
+            _queue.pop_front();
+        }
+
+        if (! idle) {
+            _slots.push_back(slot{ nullptr, nullptr, output(), false });
+            idle = &_slots.back();
+        }
+        if (! idle->_session) {
+            try {
+                idle->_session = _database.make_session_impl();
+            }
+            catch (...) {
+                output none;
+                try { j->_completion(none, std::current_exception()); } catch (...) {}
+                continue;
+            }
+        }
+        idle->_job = std::move(j);
+        start(*idle);
+    }
+}
+
+void
+async_executor::start(slot &s) {
+    try {
+        s._session->send_async(*s._job->_cmd);
+        s._flushing = ! s._session->flush_async();
+    }
+    catch (...) {
+        finish(s, std::current_exception());
+    }
+}
+
+void
+async_executor::progress(slot &s, bool readable, bool writable) {
+    try {
+        if (s._flushing && writable)
+            s._flushing = ! s._session->flush_async();
+        if (readable && s._session->receive_async(s._output))
+            finish(s, nullptr);
+    }
+    catch (...) {
+        s._output.clear();
+        finish(s, std::current_exception());
+    }
+}
+
+void
+async_executor::finish(slot &s, std::exception_ptr error) {
+    // A session whose connection has failed goes back to the pool, which discards it, and the
+    // slot gets a new one when it's next used.
+    //
+    if (error  &&  ! s._session->is_alive())  s._session.reset();
+
+    const unique_ptr<job> j = std::move(s._job);
+    output result;
+    result.swap(s._output);
+    try {
+        j->_completion(result, error);
+    }
+    catch (...) {}
+}
+
+}
@@ -0,0 +1,282 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <assert.h>
+#include <algorithm>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <quince/exceptions.h>
+#include <quince/detail/binomen.h>
+#include <quince/detail/row.h>
+#include <quince/detail/util.h>
+#include <quince/mappers/detail/persistent_column_mapper.h>
+#include <quince_postgresql/database.h>
+#include <quince_postgresql/detail/binary_format.h>
+#include <quince_postgresql/detail/dialect_sql.h>
+
+using boost::posix_time::ptime;
+using namespace quince;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+
+namespace quince_postgresql {
+
+namespace {
+    // Send the data of a COPY whenever this much has been encoded.
+    //
+    const size_t copy_chunk_size = 1 << 20;
+
+    void
+    append_copy_header(string &dest) {
+        static const char signature[] = "PGCOPY\n\377\r\n";
+        dest.append(signature, sizeof(signature));  // including the terminating '\0'
+        append_big_endian<int32_t>(0, dest);        // flags
+        append_big_endian<int32_t>(0, dest);        // header extension length
+    }
+
+    void
+    append_copy_trailer(string &dest) {
+        append_big_endian<int16_t>(-1, dest);
+    }
+
+    // quince::timestamp holds text, but binary COPY needs PostgreSQL's own representation:
+    // microseconds since 2000-01-01.  (ptimes are already in that form.)
+    //
+    void
+    append_timestamp_field(const cell &c, string &dest) {
+        static const ptime postgres_epoch(boost::gregorian::date(2000, 1, 1));
+        const string text(static_cast<const char *>(c.data()), c.size());
+        const int64_t microseconds = (boost::posix_time::time_from_string(text) - postgres_epoch).total_microseconds();
+        append_big_endian<int32_t>(sizeof(int64_t), dest);
+        append_big_endian(microseconds, dest);
+    }
+
+    void
+    append_copy_tuple(const row &r, const vector<string> &column_names, string &dest) {
+        append_big_endian(boost::numeric_cast<int16_t>(column_names.size()), dest);
+        for (const string &name: column_names) {
+            const cell *const c = r.find_cell(name);
+            if (c == nullptr)
+                throw malformed_results_exception();
+            else if (c->type() == column_type::none)
+                append_big_endian<int32_t>(-1, dest);
+            else if (c->type() == column_type::timestamp  &&  ! c->has_binary_format())
+                append_timestamp_field(*c, dest);
+            else {
+                append_big_endian(boost::numeric_cast<int32_t>(c->size()), dest);
+                dest.append(static_cast<const char *>(c->data()), c->size());
+            }
+        }
+    }
+
+    // The mapper's columns that are present in r, which excludes e.g. a serial
+    // that's left for the DBMS to generate.
+    //
+    vector<string>
+    copied_column_names(const abstract_mapper_base &mapper, const row &r) {
+        vector<string> result;
+        mapper.for_each_persistent_column([&](const persistent_column_mapper &p) {
+            if (r.find_cell(p.name()) != nullptr)  result.push_back(p.name());
+        });
+        return result;
+    }
+
+    // Values, converted to rows and then regrouped by column, for a statement that takes each
+    // column as an array parameter.  The columns are those present in the first row.
+    //
+    class column_arrays {
+    public:
+        column_arrays(const database &database, const abstract_mapper_base &mapper) :
+            _database(database),
+            _mapper(mapper),
+            _have_columns(false)
+        {}
+
+        // Clear the arrays, then fill them with up to batch_size rows from next().  Returns the
+        // number of rows.
+        //
+        size_t
+        fill(const std::function<bool(row &)> &next, size_t batch_size) {
+            for (vector<cell> &c: _columns)  c.clear();
+
+            size_t n_rows = 0;
+            for (; n_rows < batch_size; n_rows++) {
+                row r(&_database);
+                if (! next(r))  break;
+
+                if (! _have_columns)  choose_columns(r);
+                for (size_t i = 0; i < _names.size(); i++) {
+                    const cell *const c = r.find_cell(_names[i]);
+                    if (c == nullptr)  throw malformed_results_exception();
+                    _columns[i].push_back(*c);
+                }
+            }
+            return n_rows;
+        }
+
+        const vector<string> &names() const                 { return _names; }
+        const vector<column_type> &types() const            { return _types; }
+        const vector<vector<cell>> &columns() const         { return _columns; }
+
+    private:
+        void
+        choose_columns(const row &r) {
+            _names = copied_column_names(_mapper, r);
+            _mapper.for_each_persistent_column([&](const persistent_column_mapper &p) {
+                if (r.find_cell(p.name()) != nullptr)  _types.push_back(p.get_column_type(false));
+            });
+            _columns.resize(_names.size());
+            _have_columns = true;
+        }
+
+        const database &_database;
+        const abstract_mapper_base &_mapper;
+        bool _have_columns;
+        vector<string> _names;
+        vector<column_type> _types;
+        vector<vector<cell>> _columns;
+    };
+}
+
+uint64_t
+database::bulk_insert_rows(
+    const binomen &table,
+    const abstract_mapper_base &mapper,
+    const std::function<bool(row &)> &next,
+    size_t batch_size
+) const {
+    assert(batch_size != 0);
+
+    const auto next_row = [&]() -> unique_ptr<row> {
+        unique_ptr<row> result = quince::make_unique<row>(this);
+        if (! next(*result))  return nullptr;
+        return result;
+    };
+
+    unique_ptr<row> pending = next_row();
+    if (! pending)  return 0;
+
+    const vector<string> column_names = copied_column_names(mapper, *pending);
+    const shared_ptr<session_impl> session = get_session_impl();
+    uint64_t n_loaded = 0;
+
+    for (size_t batch_index = 0; pending; batch_index++) {
+        const unique_ptr<dialect_sql> cmd = make_dialect_sql();
+        cmd->write_copy_from_stdin(table, column_names);
+
+        size_t n_in_batch = 0;
+        try {
+            session->copy_in(*cmd, [&](string &chunk) {
+                if (n_in_batch == 0)  append_copy_header(chunk);
+                while (pending  &&  n_in_batch < batch_size  &&  chunk.size() < copy_chunk_size) {
+                    append_copy_tuple(*pending, column_names, chunk);
+                    n_in_batch++;
+                    pending = next_row();
+                }
+                if (pending  &&  n_in_batch < batch_size)  return true;
+
+                append_copy_trailer(chunk);
+                return false;
+            });
+        }
+        catch (const deadlock_exception &)          { throw; }
+        catch (const broken_connection_exception &) { throw; }
+        catch (const statement_timeout_exception &) { throw; }
+        catch (const dbms_exception &e) {
+            throw bulk_insert_exception(e.what(), batch_index, n_loaded);
+        }
+        n_loaded += n_in_batch;
+    }
+    return n_loaded;
+}
+
+vector<serial>
+database::insert_rows_with_readback(
+    const binomen &table,
+    const abstract_mapper_base &mapper,
+    const std::function<bool(row &)> &next,
+    const serial_mapper &readback_mapper,
+    size_t batch_size
+) const {
+    assert(batch_size != 0);
+
+    vector<serial> result;
+    const shared_ptr<session_impl> session = get_session_impl();
+    column_arrays batch(*this, mapper);
+
+    for (;;) {
+        const size_t n_in_batch = batch.fill(next, batch_size);
+        if (n_in_batch == 0)  return result;
+
+        // A table with no columns but the generated key gets a row of defaults per value.
+        //
+        const size_t n_statements = batch.names().empty()  ?  n_in_batch  :  1;
+        for (size_t i = 0; i < n_statements; i++) {
+            const unique_ptr<dialect_sql> cmd = make_dialect_sql();
+            if (batch.names().empty())
+                cmd->write_insert_default_values(table);
+            else
+                cmd->write_insert_from_arrays(table, batch.names(), batch.types(), batch.columns());
+            cmd->write_returning(readback_mapper);
+
+            const vector<unique_ptr<row>> output = session->exec_with_all_output(*cmd);
+            if (output.size() != n_in_batch / n_statements)  throw malformed_results_exception();
+
+            // unnest() yields the arrays' elements in order, and the rows are inserted, and so
+            // returned, in that order.
+            //
+            for (const unique_ptr<row> &r: output) {
+                serial s;
+                readback_mapper.from_row(*r, s);
+                result.push_back(s);
+            }
+        }
+        if (n_in_batch < batch_size)  return result;
+    }
+}
+
+uint64_t
+database::upsert_rows(
+    const binomen &table,
+    const abstract_mapper_base &mapper,
+    const std::function<bool(row &)> &next,
+    const abstract_mapper_base &conflict_target,
+    conflict_action action,
+    size_t batch_size
+) const {
+    assert(batch_size != 0);
+
+    vector<string> conflict_columns;
+    conflict_target.for_each_persistent_column([&](const persistent_column_mapper &p) {
+        conflict_columns.push_back(p.name());
+    });
+
+    const shared_ptr<session_impl> session = get_session_impl();
+    column_arrays batch(*this, mapper);
+    uint64_t n_processed = 0;
+
+    for (;;) {
+        const size_t n_in_batch = batch.fill(next, batch_size);
+        if (n_in_batch == 0)  return n_processed;
+
+        vector<string> update_columns;
+        if (action == conflict_action::update)
+            for (const string &name: batch.names())
+                if (std::find(conflict_columns.begin(), conflict_columns.end(), name) == conflict_columns.end())
+                    update_columns.push_back(name);
+
+        const unique_ptr<dialect_sql> cmd = make_dialect_sql();
+        cmd->write_insert_from_arrays(table, batch.names(), batch.types(), batch.columns());
+        cmd->write_on_conflict(conflict_columns, update_columns);
+        session->exec(*cmd);
+
+        n_processed += n_in_batch;
+        if (n_in_batch < batch_size)  return n_processed;
+    }
+}
+
+}
@@ -0,0 +1,125 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <string.h>
+#include <quince/exceptions.h>
+#include <quince_postgresql/column_batch.h>
+#include <quince_postgresql/detail/binary_format.h>
+#include <quince_postgresql/detail/type_oids.h>
+
+using namespace quince;
+using std::string;
+using std::vector;
+
+
+namespace quince_postgresql {
+
+namespace {
+    // Each of these decodes a whole column in one tight loop, so that the compiler can turn
+    // read_big_endian() into a byte-swap instruction and keep everything else out of the way.
+    // libpq stores each value separately, so there's no contiguous input to vectorize further.
+
+    template<typename Wire>
+    void
+    decode_integers(const PGresult *r, int column, size_t n_rows, vector<int64_t> &dest) {
+        dest.resize(n_rows);
+        for (size_t i = 0; i < n_rows; i++) {
+            const int row = static_cast<int>(i);
+            dest[i] = PQgetisnull(r, row, column)  ?  0  :  read_big_endian<Wire>(PQgetvalue(r, row, column));
+        }
+    }
+
+    template<typename Real, typename Bits>
+    void
+    decode_reals(const PGresult *r, int column, size_t n_rows, vector<double> &dest) {
+        dest.resize(n_rows);
+        for (size_t i = 0; i < n_rows; i++) {
+            const int row = static_cast<int>(i);
+            if (PQgetisnull(r, row, column))
+                dest[i] = 0;
+            else {
+                const Bits bits = read_big_endian<Bits>(PQgetvalue(r, row, column));
+                Real value;
+                memcpy(&value, &bits, sizeof(value));
+                dest[i] = value;
+            }
+        }
+    }
+
+    void
+    decode_bytes(const PGresult *r, int column, size_t n_rows, vector<uint64_t> &offsets, string &data) {
+        offsets.resize(n_rows + 1);
+        data.clear();
+        offsets[0] = 0;
+        for (size_t i = 0; i < n_rows; i++) {
+            const int row = static_cast<int>(i);
+            if (! PQgetisnull(r, row, column))
+                data.append(PQgetvalue(r, row, column), static_cast<size_t>(PQgetlength(r, row, column)));
+            offsets[i+1] = data.size();
+        }
+    }
+}
+
+column_buffer::column_buffer() :
+    _type(column_type::none),
+    _size(0)
+{}
+
+void
+column_buffer::assign(const PGresult *r, int column) {
+    if (PQfformat(r, column) != 1)  throw malformed_results_exception();
+
+    const char *const name = PQfname(r, column);
+    if (name == nullptr)  throw malformed_results_exception();
+    _name.assign(name);
+    _type = get_column_type(PQftype(r, column));
+    _size = static_cast<size_t>(PQntuples(r));
+
+    _null_bitmap.assign((_size + 63) / 64, 0);
+    for (size_t i = 0; i < _size; i++)
+        if (PQgetisnull(r, static_cast<int>(i), column))
+            _null_bitmap[i/64] |= uint64_t(1) << (i%64);
+
+    _integers.clear();
+    _reals.clear();
+    _offsets.clear();
+    _data.clear();
+
+    switch (_type) {
+        case column_type::boolean:          decode_integers<uint8_t>(r, column, _size, _integers);  break;
+        case column_type::small_int:        decode_integers<int16_t>(r, column, _size, _integers);  break;
+        case column_type::integer:          decode_integers<int32_t>(r, column, _size, _integers);  break;
+        case column_type::big_int:          decode_integers<int64_t>(r, column, _size, _integers);  break;
+        case column_type::timestamp:        decode_integers<int64_t>(r, column, _size, _integers);  break;
+        case column_type::floating_point:   decode_reals<float, uint32_t>(r, column, _size, _reals);    break;
+        case column_type::double_precision: decode_reals<double, uint64_t>(r, column, _size, _reals);   break;
+        case column_type::string:
+        case column_type::byte_vector:      decode_bytes(r, column, _size, _offsets, _data);        break;
+        default:                            break;
+    }
+}
+
+
+column_batch::column_batch() :
+    _n_rows(0)
+{}
+
+const column_buffer &
+column_batch::column(const string &name) const {
+    for (const column_buffer &c: _columns)
+        if (c.name() == name)  return c;
+    throw malformed_results_exception();
+}
+
+void
+column_batch::assign(const PGresult *pg_result) {
+    _n_rows = static_cast<size_t>(PQntuples(pg_result));
+    const int n_cols = PQnfields(pg_result);
+    _columns.resize(static_cast<size_t>(n_cols));
+    for (int c = 0; c < n_cols; c++)
+        _columns[static_cast<size_t>(c)].assign(pg_result, c);
+}
+
+}
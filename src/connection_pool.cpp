@@ -0,0 +1,293 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include <exception>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#include <quince/exceptions.h>
+#include <quince/detail/sql.h>
+#include <quince/detail/util.h>
+#include <quince_postgresql/detail/connection_pool.h>
+#include <quince_postgresql/detail/replica_set.h>
+
+using namespace quince;
+using std::lock_guard;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+typedef std::chrono::steady_clock clock_type;
+
+
+namespace quince_postgresql {
+
+namespace {
+    // True if text is a query that can go to a standby server.  Not if it locks rows, since a
+    // standby can't do that.  (Values are always parameters, never in the text, so they can't
+    // be mistaken for locking clauses.)
+    //
+    bool
+    is_read(const string &text) {
+        static const char *const locking_clauses[] = {
+            " FOR UPDATE", " FOR NO KEY UPDATE", " FOR SHARE", " FOR KEY SHARE"
+        };
+        if (text.compare(0, 7, "SELECT ") != 0  &&  text.compare(0, 8, "(SELECT ") != 0)  return false;
+        for (const char *clause: locking_clauses)
+            if (text.find(clause) != string::npos)  return false;
+        return true;
+    }
+
+    // While it exists, a replica's session has the primary's deadline, which is what a
+    // deadline_scope sets.
+    //
+    class borrowed_deadline : private boost::noncopyable {
+    public:
+        borrowed_deadline(session_impl &replica, const session_impl &primary) :
+            _replica(replica),
+            _previous(replica.set_deadline(primary.deadline()))
+        {}
+
+        ~borrowed_deadline() {
+            _replica.set_deadline(_previous);
+        }
+
+    private:
+        session_impl &_replica;
+        const boost::optional<clock_type::time_point> _previous;
+    };
+}
+
+connection_pool::pooled_session::pooled_session(
+    const shared_ptr<connection_pool> &pool,
+    unique_ptr<session_impl> impl,
+    const shared_ptr<replica_set> &replicas
+) :
+    _pool(pool),
+    _impl(std::move(impl)),
+    _replicas(replicas)
+{}
+
+connection_pool::pooled_session::~pooled_session() {
+    _replica_sessions.clear();
+    try {
+        _pool->check_in(std::move(_impl));
+    }
+    catch (...) {}
+}
+
+bool
+connection_pool::pooled_session::unchecked_exec(const sql &cmd) {
+    return _impl->unchecked_exec(cmd);
+}
+
+void
+connection_pool::pooled_session::exec(const sql &cmd) {
+    _impl->exec(cmd);
+}
+
+result_stream
+connection_pool::pooled_session::exec_with_stream_output(const sql &cmd, uint32_t fetch_size) {
+    result_stream result;
+    if (read_from_replica(cmd, [&](session_impl &replica) { result = replica.exec_with_stream_output(cmd, fetch_size); }))
+        return result;
+    return _impl->exec_with_stream_output(cmd, fetch_size);
+}
+
+unique_ptr<row>
+connection_pool::pooled_session::exec_with_one_output(const sql &cmd) {
+    unique_ptr<row> result;
+    if (read_from_replica(cmd, [&](session_impl &replica) { result = replica.exec_with_one_output(cmd); }))
+        return result;
+    return _impl->exec_with_one_output(cmd);
+}
+
+unique_ptr<row>
+connection_pool::pooled_session::next_output(const result_stream &rs) {
+    for (const auto &replica: _replica_sessions)
+        if (replica  &&  replica->impl().owns(rs)) {
+            const borrowed_deadline borrowed(replica->impl(), *_impl);
+            return replica->impl().next_output(rs);
+        }
+    return _impl->next_output(rs);
+}
+
+bool
+connection_pool::pooled_session::read_from_replica(const sql &cmd, const std::function<void(session_impl &)> &read) {
+    // Inside a transaction, reads must see the transaction's writes, so they stay on the primary.
+    //
+    return _replicas
+        && ! _replicas->empty()
+        && is_read(cmd.get_text())
+        && _impl->outside_transaction()
+        && _replicas->try_read(_replica_sessions, [&](session_impl &replica) {
+            const borrowed_deadline borrowed(replica, *_impl);
+            read(replica);
+        });
+}
+
+
+connection_pool::connection_pool(
+    const database &database,
+    const session_impl::spec &spec,
+    const settings &settings,
+    const shared_ptr<replica_set> &replicas
+) :
+    _database(database),
+    _spec(spec),
+    _replicas(replicas),
+    _settings(settings),
+    _size(0),
+    _closed(false)
+{}
+
+connection_pool::~connection_pool()
+{}
+
+void
+connection_pool::configure(const settings &settings) {
+    vector<unique_ptr<session_impl>> expired;
+    {
+        const lock_guard<mutex> lock(_mutex);
+        _settings = settings;
+        expired = take_expired();
+    }
+    _returned.notify_all();
+}
+
+unique_ptr<connection_pool::pooled_session>
+connection_pool::check_out() {
+    vector<unique_ptr<session_impl>> discards;
+    unique_lock<mutex> lock(_mutex);
+
+    for (;;) {
+        while (! _idle.empty()) {
+            unique_ptr<session_impl> candidate = std::move(_idle.back()._session);
+            _idle.pop_back();
+            if (candidate->is_alive())
+                return quince::make_unique<pooled_session>(shared_from_this(), std::move(candidate), _replicas);
+
+            _size--;
+            discards.push_back(std::move(candidate));
+        }
+
+        if (_size < _settings._max_size) {
+            const size_t shortfall = _settings._min_size > _size  ?  _settings._min_size - _size  :  0;
+            open_into_idle(lock, std::min(std::max<size_t>(shortfall, 1), _settings._max_size - _size));
+        }
+        else
+            _returned.wait(lock);
+    }
+}
+
+void
+connection_pool::prewarm() {
+    unique_lock<mutex> lock(_mutex);
+    const size_t target = std::min(_settings._min_size, _settings._max_size);
+    if (_size < target)  open_into_idle(lock, target - _size);
+}
+
+void
+connection_pool::close() {
+    std::deque<idle_session> idle;
+    {
+        const lock_guard<mutex> lock(_mutex);
+        _closed = true;
+        _size -= _idle.size();
+        idle.swap(_idle);
+    }
+    _returned.notify_all();
+}
+
+void
+connection_pool::check_in(unique_ptr<session_impl> session) {
+    {
+        const lock_guard<mutex> lock(_mutex);
+        if (_closed) {
+            _size--;
+            session->abandon();
+            return;
+        }
+    }
+    const bool reusable = session->reset_for_reuse();
+    vector<unique_ptr<session_impl>> expired;
+    {
+        const lock_guard<mutex> lock(_mutex);
+        if (reusable)
+            _idle.push_back({ std::move(session), clock_type::now() });
+        else
+            _size--;
+        expired = take_expired();
+    }
+    _returned.notify_one();
+}
+
+vector<unique_ptr<session_impl>>
+connection_pool::open(size_t n) {
+    vector<unique_ptr<session_impl>> result;
+    std::exception_ptr first_failure;
+
+    for (PGconn *conn: session_impl::connect(_spec, n)) {
+        try {
+            result.push_back(quince::make_unique<session_impl>(_database, _spec, conn));
+        }
+        catch (...) {
+            if (! first_failure)  first_failure = std::current_exception();
+        }
+    }
+    if (result.empty()) {
+        if (first_failure)  std::rethrow_exception(first_failure);
+        throw failed_connection_exception();
+    }
+    return result;
+}
+
+void
+connection_pool::open_into_idle(unique_lock<mutex> &lock, size_t n) {
+    // Reserve the places, so that other threads don't overshoot _max_size while we're
+    // connecting without the lock.
+    //
+    _size += n;
+    lock.unlock();
+
+    vector<unique_ptr<session_impl>> opened;
+    try {
+        opened = open(n);
+    }
+    catch (...) {
+        lock.lock();
+        _size -= n;
+        _returned.notify_all();
+        throw;
+    }
+
+    lock.lock();
+    _size -= n - opened.size();
+    const clock_type::time_point now = clock_type::now();
+    for (auto &s: opened)
+        _idle.push_back({ std::move(s), now });
+    _returned.notify_all();
+}
+
+vector<unique_ptr<session_impl>>
+connection_pool::take_expired() {
+    vector<unique_ptr<session_impl>> result;
+    const clock_type::time_point now = clock_type::now();
+
+    while (! _idle.empty()
+        && _size > _settings._min_size
+        && now - _idle.front()._since > _settings._idle_timeout
+    ) {
+        result.push_back(std::move(_idle.front()._session));
+        _idle.pop_front();
+        _size--;
+    }
+    return result;
+}
+
+}
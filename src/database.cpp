@@ -4,6 +4,7 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 
 #include <pg_config_manual.h>  // for NAMEDATALEN
+#include <limits>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <quince/exceptions.h>
 #include <quince/detail/compiler_specific.h>
@@ -16,6 +17,7 @@
 #include <quince/mappers/detail/abstract_mapper.h>
 #include <quince/mappers/serial_mapper.h>
 #include <quince_postgresql/database.h>
+#include <quince_postgresql/detail/binary_format.h>
 #include <quince_postgresql/detail/dialect_sql.h>
 
 using boost::optional;
@@ -33,6 +35,9 @@ QUINCE_SUPPRESS_MSVC_DOMINANCE_WARNING
 namespace quince_postgresql {
 
 namespace {
+    // ptimes travel in PostgreSQL's binary timestamp format: big-endian microseconds since
+    // 2000-01-01, with the extreme values standing for infinities.
+    //
     class ptime_mapper : public abstract_mapper<ptime>, public direct_mapper<timestamp>
     {
     public:
@@ -48,20 +53,59 @@ namespace {
         }
 
         virtual void from_row(const row &src, ptime &dest) const override {
-            timestamp text;
-            direct_mapper<timestamp>::from_row(src, text);
-            dest = boost::posix_time::time_from_string(text);
+            timestamp retrieved;
+            direct_mapper<timestamp>::from_row(src, retrieved);
+            const string bytes = retrieved;
+
+            if (! src.find_cell(name())->has_binary_format()) {
+                // Text, e.g. from a DBMS-side cast.
+                //
+                if (bytes == "infinity")        dest = ptime(boost::posix_time::pos_infin);
+                else if (bytes == "-infinity")  dest = ptime(boost::posix_time::neg_infin);
+                else                            dest = boost::posix_time::time_from_string(bytes);
+                return;
+            }
+            if (bytes.size() != sizeof(int64_t))  throw malformed_results_exception();
+
+            const int64_t microseconds = read_big_endian<int64_t>(bytes.data());
+
+            if (microseconds == std::numeric_limits<int64_t>::max())
+                dest = ptime(boost::posix_time::pos_infin);
+            else if (microseconds == std::numeric_limits<int64_t>::min())
+                dest = ptime(boost::posix_time::neg_infin);
+            else
+                dest = postgres_epoch() + boost::posix_time::microseconds(microseconds);
         }
 
         virtual void to_row(const ptime &src, row &dest) const override {
-            const timestamp text(boost::posix_time::to_simple_string(src));
-            direct_mapper<timestamp>::to_row(text, dest);
+            if (src.is_not_a_date_time()) {
+                // Let the DBMS reject it, as it always has.
+                //
+                direct_mapper<timestamp>::to_row(timestamp(boost::posix_time::to_simple_string(src)), dest);
+                return;
+            }
+
+            const int64_t microseconds =
+                  src.is_pos_infinity() ?   std::numeric_limits<int64_t>::max()
+                : src.is_neg_infinity() ?   std::numeric_limits<int64_t>::min()
+                :                           (src - postgres_epoch()).total_microseconds();
+
+            string bytes;
+            append_big_endian(microseconds, bytes);
+            dest.add_cell(cell(column_type::timestamp, true, bytes.data(), bytes.size()), name());
         }
 
     protected:
         virtual void build_match_tester(const query_base &qb, predicate &result) const override {
             abstract_mapper<ptime>::build_match_tester(qb, result);
         }
+
+    private:
+        static const ptime &
+        postgres_epoch() {
+            static const ptime result(boost::gregorian::date(2000, 1, 1));
+            return result;
+        }
     };
 
     struct customization_for_dbms : mapping_customization {
@@ -84,6 +128,16 @@ namespace {
         }
     };
 
+    const size_t default_statement_cache_capacity = 256;
+    const uint32_t default_stream_prefetch_depth = 1;
+    const size_t default_stream_memory_budget = 0;
+
+    const connection_pool::settings default_pool_settings = {
+        0,
+        std::numeric_limits<size_t>::max(),
+        std::chrono::minutes(5)
+    };
+
     optional<std::string>
     to_optional(const std::string &s) {
         if (s.empty())  return boost::none;
@@ -112,34 +166,76 @@ database::database(
         to_optional(db_name),
         to_optional(default_schema),
         to_optional(port),
-        level
-    })
+        level,
+        default_statement_cache_capacity,
+        default_stream_prefetch_depth,
+        default_stream_memory_budget,
+        std::make_shared<statement_tracing>(),
+        std::chrono::milliseconds(0),
+        stream_mode::cursor
+    }),
+    _replicas(std::make_shared<replica_set>(*this, default_pool_settings)),
+    _pool(std::make_shared<connection_pool>(*this, _spec, default_pool_settings, _replicas)),
+    _column_titles_generation(0)
 {}
 
 
-database::~database()
-{}
+database::~database() {
+    _pool->close();
+    _replicas->close();
+}
 
 std::unique_ptr<sql>
 database::make_sql() const {
     return make_dialect_sql();
 }
 
+void
+database::configure_connection_pool(size_t min_size, size_t max_size, std::chrono::seconds idle_timeout) {
+    _pool->configure({ min_size, max_size, idle_timeout });
+    _replicas->configure({ min_size, max_size, idle_timeout });
+}
+
+void
+database::add_replica(const std::string &host, const std::string &port) {
+    session_impl::spec replica_spec = _spec;
+    replica_spec._host = host;
+    replica_spec._port = to_optional(port);
+    _replicas->add(replica_spec);
+}
+
+void
+database::set_replica_policy(replica_policy policy, std::chrono::milliseconds max_lag) {
+    _replicas->set_policy(policy, max_lag);
+}
+
+void
+database::prewarm_connections() const {
+    _pool->prewarm();
+}
+
 void
 database::create_schema(const std::string &schema_name) const {
     const unique_ptr<dialect_sql> cmd = make_dialect_sql();
     cmd->write_create_schema(schema_name);
-    make_schemaless_session()->exec(*cmd);
+    get_session_impl()->exec(*cmd);
 }
 
 bool
 database::create_schema_if_not_exists(const optional<string> &schema_name) const {
-    if (! schema_name  ||   _named_schemas_known_to_exist.count(*schema_name))
-        return false;
+    if (! schema_name)  return false;
+    {
+        const std::lock_guard<std::mutex> lock(_named_schemas_mutex);
+        if (_named_schemas_known_to_exist.count(*schema_name))  return false;
+    }
 
+    // Not holding the lock meanwhile, so another thread may be doing the same.  No harm done.
+    //
     const unique_ptr<dialect_sql> cmd = make_dialect_sql();
     cmd->write_create_schema(*schema_name);
-    const bool result = make_schemaless_session()->unchecked_exec(*cmd);
+    const bool result = get_session_impl()->unchecked_exec(*cmd);
+
+    const std::lock_guard<std::mutex> lock(_named_schemas_mutex);
     _named_schemas_known_to_exist.insert(*schema_name);
     return result;
 }
@@ -154,31 +250,84 @@ database::make_enclosure_available(const optional<string> &enclosure_name) const
     create_schema_if_not_exists(enclosure_name);
 }
 
-unique_ptr<session_impl>
-database::make_schemaless_session() const {
-    session_impl::spec s = _spec;
-    s._default_schema = boost::none;
-    return quince::make_unique<session_impl>(*this, s);
-}
-
 new_session
 database::make_session() const {
-    new_session result = quince::make_unique<session_impl>(*this, _spec);
-    if (const optional<string> default_schema = get_default_enclosure()) {
-        const unique_ptr<sql> cmd = make_sql();
-        cmd->write_set_search_path(*default_schema);
-        result->exec(*cmd);
-    }
-    return result;
+    return _pool->check_out();
 }
 
 vector<string>
 database::retrieve_column_titles(const binomen &table) const {
+    if (const optional<vector<string>> cached = cached_column_titles(table))  return *cached;
+
+    // Not there (e.g. because the table doesn't exist, or is found elsewhere on the search
+    // path), so let the DBMS resolve the name, and report any error.
+    //
     const unique_ptr<sql> cmd = make_sql();
     cmd->write_select_none(table);
     return get_session_impl()->exec_with_metadata_output(*cmd);
 }
 
+optional<vector<string>>
+database::cached_column_titles(const binomen &table) const {
+    uint64_t generation;
+    {
+        const std::lock_guard<std::mutex> lock(_column_titles_mutex);
+        generation = _column_titles_generation;
+        const auto schema = _column_titles.find(table._enclosure);
+        if (schema != _column_titles.end()) {
+            const auto found = schema->second.find(table._local);
+            if (found == schema->second.end())  return boost::none;
+            return found->second;
+        }
+    }
+
+    // Load the whole schema in one round trip, since whoever wants one table's columns usually
+    // wants its neighbours' too.
+    //
+    schema_column_titles loaded = get_session_impl()->retrieve_schema_column_titles(table._enclosure);
+    const auto found = loaded.find(table._local);
+    const optional<vector<string>> result = found == loaded.end()  ?  optional<vector<string>>()  :  found->second;
+
+    // If the titles were forgotten meanwhile, then what we loaded may predate the change that
+    // caused it, so it's good enough for this call but not for the cache.
+    //
+    const std::lock_guard<std::mutex> lock(_column_titles_mutex);
+    if (_column_titles_generation == generation)
+        _column_titles.insert(std::make_pair(table._enclosure, std::move(loaded)));
+    return result;
+}
+
+void
+database::forget_column_titles() const {
+    const std::lock_guard<std::mutex> lock(_column_titles_mutex);
+    _column_titles.clear();
+    _column_titles_generation++;
+}
+
+void
+database::exec_with_columnar_output(
+    const string &select_text,
+    uint32_t fetch_size,
+    const std::function<void(const column_batch &)> &consume
+) const {
+    const unique_ptr<dialect_sql> cmd = make_dialect_sql();
+    cmd->write(select_text);
+    get_session_impl()->exec_with_columnar_output(*cmd, fetch_size, consume);
+}
+
+void
+database::exec_with_result_output(
+    const string &text,
+    const vector<cell> &params,
+    const vector<Oid> &param_types,
+    const std::function<void(const PGresult *)> &consume
+) const {
+    const unique_ptr<dialect_sql> cmd = make_dialect_sql();
+    cmd->write(text);
+    for (size_t i = 0; i < params.size(); i++)  cmd->attach_parameter(params[i], param_types[i]);
+    get_session_impl()->exec_with_result_output(*cmd, consume);
+}
+
 serial
 database::insert_with_readback(unique_ptr<sql> insert, const serial_mapper &readback_mapper) const {
     insert->write_returning(readback_mapper);
@@ -209,7 +358,15 @@ database::column_type_name(column_type type) const {
 
 shared_ptr<session_impl>
 database::get_session_impl() const {
-    return dynamic_pointer_cast<session_impl>(get_session());
+    const shared_ptr<connection_pool::pooled_session> pooled =
+        dynamic_pointer_cast<connection_pool::pooled_session>(get_session());
+    return shared_ptr<session_impl>(pooled, &pooled->impl());
+}
+
+shared_ptr<session_impl>
+database::make_session_impl() const {
+    const shared_ptr<connection_pool::pooled_session> pooled = _pool->check_out();
+    return shared_ptr<session_impl>(pooled, &pooled->impl());
 }
 
 unique_ptr<dialect_sql>
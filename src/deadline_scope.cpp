@@ -0,0 +1,31 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <quince_postgresql/database.h>
+#include <quince_postgresql/deadline_scope.h>
+
+using boost::optional;
+
+typedef std::chrono::steady_clock clock_type;
+
+
+namespace quince_postgresql {
+
+deadline_scope::deadline_scope(const database &database, clock_type::time_point deadline) :
+    _session(database.get_session_impl())
+{
+    _previous = _session->set_deadline(deadline);
+    if (_previous  &&  *_previous < deadline)  _session->set_deadline(_previous);
+}
+
+deadline_scope::deadline_scope(const database &database, clock_type::duration timeout) :
+    deadline_scope(database, clock_type::now() + timeout)
+{}
+
+deadline_scope::~deadline_scope() {
+    _session->set_deadline(_previous);
+}
+
+}
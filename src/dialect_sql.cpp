@@ -3,6 +3,7 @@
 //    (See accompanying file ../LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 
+#include <algorithm>
 #include <boost/date_time/posix_time/ptime.hpp>
 #include <quince/detail/binomen.h>
 #include <quince/mappers/detail/persistent_column_mapper.h>
@@ -12,7 +13,9 @@
 #include <quince/detail/util.h>
 #include <quince/query.h>
 #include <quince_postgresql/database.h>
+#include <quince_postgresql/detail/binary_format.h>
 #include <quince_postgresql/detail/dialect_sql.h>
+#include <quince_postgresql/detail/type_oids.h>
 
 using namespace quince;
 using boost::optional;
@@ -72,6 +75,81 @@ dialect_sql::write_create_schema(const std::string &schema_name) {
     write_quoted(schema_name);
 }
 
+void
+dialect_sql::write_copy_from_stdin(const binomen &table, const vector<string> &column_names) {
+    write("COPY ");
+    write_quoted(table);
+    write(" (");
+    comma_separated_list_scope list_scope(*this);
+    for (const string &name: column_names) {
+        list_scope.start_item();
+        write_quoted(name);
+    }
+    write(") FROM STDIN (FORMAT binary)");
+}
+
+void
+dialect_sql::write_insert_from_arrays(
+    const binomen &table,
+    const vector<string> &column_names,
+    const vector<column_type> &column_types,
+    const vector<vector<cell>> &columns
+) {
+    assert(! column_names.empty());
+    assert(column_types.size() == column_names.size()  &&  columns.size() == column_names.size());
+
+    write("INSERT INTO ");
+    write_quoted(table);
+    write(" (");
+    {
+        comma_separated_list_scope list_scope(*this);
+        for (const string &name: column_names) {
+            list_scope.start_item();
+            write_quoted(name);
+        }
+    }
+    write(") SELECT * FROM unnest(");
+    comma_separated_list_scope list_scope(*this);
+    for (size_t i = 0; i < columns.size(); i++) {
+        list_scope.start_item();
+        write_array_parameter(column_types[i], columns[i]);
+    }
+    write(")");
+}
+
+void
+dialect_sql::write_insert_default_values(const binomen &table) {
+    write("INSERT INTO ");
+    write_quoted(table);
+    write(" DEFAULT VALUES");
+}
+
+void
+dialect_sql::write_on_conflict(const vector<string> &conflict_columns, const vector<string> &update_columns) {
+    write(" ON CONFLICT (");
+    {
+        comma_separated_list_scope list_scope(*this);
+        for (const string &name: conflict_columns) {
+            list_scope.start_item();
+            write_quoted(name);
+        }
+    }
+    write(")");
+
+    if (update_columns.empty()) {
+        write(" DO NOTHING");
+        return;
+    }
+    write(" DO UPDATE SET ");
+    comma_separated_list_scope list_scope(*this);
+    for (const string &name: update_columns) {
+        list_scope.start_item();
+        write_quoted(name);
+        write(" = EXCLUDED.");
+        write_quoted(name);
+    }
+}
+
 void
 dialect_sql::write_returning(const abstract_mapper_base &mapper) {
     write(" RETURNING ");
@@ -135,12 +213,18 @@ namespace {
         return dynamic_cast<const abstract_mapper<T>*>(&c) != nullptr;
     }
 
+    // quince::timestamp columns are retrieved as text.  ptime columns (whose mapper is also
+    // a timestamp mapper) are retrieved in binary, and converted by the ptime mapper.
+    //
+    bool
+    is_text_timestamp_column(const column_mapper &c) {
+        return (maps_to<timestamp>(c) || maps_to<optional<timestamp>>(c))
+            && ! (maps_to<ptime>(c) || maps_to<optional<ptime>>(c));
+    }
+
     bool
-    is_timestamp_column(const column_mapper &c) {
-        return maps_to<timestamp>(c)
-            || maps_to<ptime>(c)
-            || maps_to<optional<timestamp>>(c)
-            || maps_to<optional<ptime>>(c);
+    is_text_timestamp(const cell &value) {
+        return value.type() == column_type::timestamp  &&  ! value.has_binary_format();
     }
 }
 
@@ -157,7 +241,7 @@ dialect_sql::write_timestamp_select_list_item(const column_mapper &c) {
 
 void
 dialect_sql::write_select_list_item(const column_mapper &c) {
-    if (is_timestamp_column(c) && !nested_select())
+    if (is_text_timestamp_column(c) && !nested_select())
         write_timestamp_select_list_item(c);
     else
         sql::write_select_list_item(c);
@@ -217,15 +301,45 @@ dialect_sql::write_set_columns_types(
     });
 }
 
+void
+dialect_sql::write_select_column_catalog(const optional<string> &schema_name) {
+    write(
+        "SELECT c.relname::text, a.attname::text, a.atttypid::bigint"
+        " FROM pg_catalog.pg_attribute a"
+        " JOIN pg_catalog.pg_class c ON c.oid = a.attrelid"
+        " JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace"
+        " WHERE n.nspname = "
+    );
+    if (schema_name)
+        write(next_value_reference(cell(column_type::string, false, schema_name->data(), schema_name->size())));
+    else
+        write("current_schema()");
+    write(
+        " AND a.attnum > 0 AND NOT a.attisdropped"
+        " AND c.relkind IN ('r', 'v', 'm', 'f', 'p')"
+        " ORDER BY c.relname, a.attnum"
+    );
+}
+
+void
+dialect_sql::write_select_replication_lag() {
+    write(
+        "SELECT CASE"
+        " WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0"
+        " ELSE COALESCE(EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp()), 0)"
+        " END::float8"
+    );
+}
+
 void
 dialect_sql::write_fetch(const string &cursor_name, uint32_t n_rows) {
     write("FETCH FORWARD " + to_string(n_rows) + " IN " + cursor_name);
 }
 
 void
-dialect_sql::prepend_declare_cursor(const string &cursor_name) {
+dialect_sql::prepend_declare_cursor(const string &cursor_name, bool with_hold) {
     sql::text_insertion_scope before(*this, 0);
-    write("DECLARE " + cursor_name + " CURSOR WITH HOLD FOR ");
+    write("DECLARE " + cursor_name + (with_hold ? " CURSOR WITH HOLD FOR " : " CURSOR FOR "));
 }
 
 void
@@ -233,6 +347,21 @@ dialect_sql::write_close_cursor(const string &cursor_name) {
     write("CLOSE " + cursor_name);
 }
 
+void
+dialect_sql::write_close_all_cursors() {
+    write("CLOSE ALL");
+}
+
+void
+dialect_sql::write_deallocate(const string &statement_name) {
+    write("DEALLOCATE " + statement_name);
+}
+
+void
+dialect_sql::write_rollback() {
+    write("ROLLBACK");
+}
+
 void
 dialect_sql::write_set_session_characteristics(isolation_level isolation) {
     write("SET SESSION CHARACTERISTICS AS TRANSACTION ISOLATION LEVEL ");
@@ -245,9 +374,34 @@ dialect_sql::write_set_session_characteristics(isolation_level isolation) {
     }
 }
 
+void
+dialect_sql::write_array_parameter(column_type element_type, const vector<cell> &elements) {
+    // Text timestamps are sent as text[], and cast, just as single text timestamps are.
+    //
+    const bool as_text = element_type == column_type::timestamp
+        && std::any_of(elements.begin(), elements.end(), [](const cell &e) { return is_text_timestamp(e); });
+    const Oid element_type_oid = standard_type_oid(as_text ? column_type::string : element_type);
+
+    string array;
+    append_array(element_type_oid, elements, array);
+
+    write(next_placeholder());
+    if (as_text)  write("::timestamp[]");
+    _parameter_type_overrides[_next_placeholder_serial-1] = array_type_oid(element_type_oid);
+    sql::attach_value(cell(column_type::byte_vector, true, array.data(), array.size()));
+}
+
+void
+dialect_sql::attach_parameter(const cell &value, Oid type_oid) {
+    if (type_oid != InvalidOid  &&  type_oid != standard_type_oid(value.type()))
+        _parameter_type_overrides[_next_placeholder_serial] = type_oid;
+    _next_placeholder_serial++;
+    attach_value(value);
+}
+
 void
 dialect_sql::attach_value(const cell &value) {
-    if (value.type() == column_type::timestamp)
+    if (is_text_timestamp(value))
         sql::attach_value(cell(column_type::string, false, value.data(), value.size()));
     else
         sql::attach_value(value);
@@ -261,7 +415,7 @@ dialect_sql::next_placeholder() {
 string
 dialect_sql::next_value_reference(const cell &value) {
     string result = sql::next_value_reference(value);
-    if (value.type() == column_type::timestamp)  result += "::timestamp";
+    if (is_text_timestamp(value))  result += "::timestamp";
     return result;
 }
 
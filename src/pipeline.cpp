@@ -0,0 +1,48 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <exception>
+#include <quince_postgresql/database.h>
+#include <quince_postgresql/pipeline.h>
+
+
+namespace quince_postgresql {
+
+namespace {
+    int
+    uncaught_exception_count() {
+#if defined(__cpp_lib_uncaught_exceptions)
+        return std::uncaught_exceptions();
+#else
+        return std::uncaught_exception() ? 1 : 0;
+#endif
+    }
+}
+
+pipeline::pipeline(const database &database) :
+    _session(database.get_session_impl()),
+    _open(false),
+    _uncaught_exceptions(uncaught_exception_count())
+{
+    _session->start_pipeline();
+    _open = true;
+}
+
+pipeline::~pipeline() {
+    if (_open) {
+        try {
+            _session->close_pipeline(uncaught_exception_count() > _uncaught_exceptions);
+        }
+        catch (...) {}
+    }
+}
+
+void
+pipeline::sync() {
+    _open = false;
+    _session->finish_pipeline();
+}
+
+}
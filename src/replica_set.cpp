@@ -0,0 +1,205 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <quince/detail/util.h>
+#include <quince/exceptions.h>
+#include <quince_postgresql/database.h>
+#include <quince_postgresql/detail/binary_format.h>
+#include <quince_postgresql/detail/dialect_sql.h>
+#include <quince_postgresql/detail/replica_set.h>
+
+using boost::optional;
+using std::unique_ptr;
+using std::vector;
+
+
+namespace quince_postgresql {
+
+namespace {
+    // How long a replica is left alone after its connection fails.
+    //
+    const std::chrono::seconds retry_interval(5);
+
+    // How long a lag measurement is trusted.
+    //
+    const std::chrono::seconds lag_probe_interval(1);
+
+    // True if e is PostgreSQL's read_only_sql_transaction error (SQLSTATE 25006), which a
+    // standby gives for a query that turns out to write, e.g. by calling a function that does.
+    //
+    bool
+    is_read_only_violation(const quince::dbms_exception &e) {
+        const std::string message = e.what();
+        return message.find("ERROR:  cannot execute ") == 0
+            && message.find(" in a read-only transaction") != std::string::npos;
+    }
+
+    class in_flight_scope : private boost::noncopyable {
+    public:
+        explicit in_flight_scope(std::atomic<uint32_t> &counter) :
+            _counter(counter)
+        {
+            _counter++;
+        }
+
+        ~in_flight_scope() {
+            _counter--;
+        }
+
+    private:
+        std::atomic<uint32_t> &_counter;
+    };
+}
+
+replica_set::replica::replica(
+    const database &database,
+    const session_impl::spec &spec,
+    const connection_pool::settings &settings
+) :
+    _spec(spec),
+    _pool(std::make_shared<connection_pool>(database, _spec, settings)),
+    _in_flight(0),
+    _down_until(0),
+    _lag_measured(0),
+    _lag_us(0)
+{}
+
+
+replica_set::replica_set(const database &database, const connection_pool::settings &pool_settings) :
+    _database(database),
+    _pool_settings(pool_settings),
+    _policy(replica_policy::round_robin),
+    _max_lag(std::chrono::seconds(1)),
+    _next(0)
+{}
+
+replica_set::~replica_set()
+{}
+
+void
+replica_set::add(const session_impl::spec &spec) {
+    _replicas.push_back(quince::make_unique<replica>(_database, spec, _pool_settings));
+}
+
+void
+replica_set::set_policy(replica_policy policy, std::chrono::milliseconds max_lag) {
+    _policy = policy;
+    _max_lag = max_lag;
+}
+
+void
+replica_set::configure(const connection_pool::settings &pool_settings) {
+    _pool_settings = pool_settings;
+    for (const auto &r: _replicas)  r->_pool->configure(pool_settings);
+}
+
+bool
+replica_set::try_read(
+    vector<unique_ptr<connection_pool::pooled_session>> &sessions,
+    const std::function<void(session_impl &)> &read
+) {
+    const optional<size_t> chosen = choose();
+    if (! chosen)  return false;
+
+    replica &r = *_replicas[*chosen];
+    sessions.resize(_replicas.size());
+    unique_ptr<connection_pool::pooled_session> &session = sessions[*chosen];
+    try {
+        if (! session)  session = r._pool->check_out();
+        if (_policy == replica_policy::lag_aware  &&  ! lag_acceptable(r, session->impl()))  return false;
+
+        const in_flight_scope scope(r._in_flight);
+        try {
+            read(session->impl());
+        }
+        catch (const quince::dbms_exception &e) {
+            // The query writes after all.  Outside a transaction it has done nothing, so the
+            // primary can run it instead.
+            //
+            if (is_read_only_violation(e)  &&  session->impl().outside_transaction())  return false;
+            throw;
+        }
+        return true;
+    }
+    catch (...) {
+        // If the statement failed on its merits, then it would fail on the primary too.
+        //
+        if (session  &&  session->impl().is_alive())  throw;
+
+        r._down_until = (clock_type::now() + retry_interval).time_since_epoch().count();
+        session.reset();
+        return false;
+    }
+}
+
+void
+replica_set::close() {
+    for (const auto &r: _replicas)  r->_pool->close();
+}
+
+optional<size_t>
+replica_set::choose() {
+    const size_t n = _replicas.size();
+    if (n == 0)  return boost::none;
+
+    const int64_t now = clock_type::now().time_since_epoch().count();
+    const size_t start = static_cast<size_t>(_next++ % n);  // so that ties are broken fairly
+    optional<size_t> result;
+    uint32_t fewest_in_flight = std::numeric_limits<uint32_t>::max();
+    for (size_t i = 0; i < n; i++) {
+        const size_t candidate = (start + i) % n;
+        const replica &r = *_replicas[candidate];
+        if (! usable(r, now))  continue;
+        if (_policy == replica_policy::round_robin)  return candidate;
+
+        const uint32_t in_flight = r._in_flight;
+        if (in_flight < fewest_in_flight) {
+            result = candidate;
+            fewest_in_flight = in_flight;
+        }
+    }
+    return result;
+}
+
+bool
+replica_set::usable(const replica &r, int64_t now) const {
+    if (r._down_until > now)  return false;
+    if (_policy != replica_policy::lag_aware  ||  r._lag_measured == 0)  return true;
+
+    // A replica that was too far behind might have caught up by now.
+    //
+    const bool stale = now - r._lag_measured > clock_type::duration(lag_probe_interval).count();
+    return stale  ||  r._lag_us <= _max_lag.count();
+}
+
+bool
+replica_set::lag_acceptable(replica &r, session_impl &session) {
+    const int64_t now = clock_type::now().time_since_epoch().count();
+    if (r._lag_measured == 0  ||  now - r._lag_measured > clock_type::duration(lag_probe_interval).count()) {
+        const unique_ptr<dialect_sql> cmd = _database.make_dialect_sql();
+        cmd->write_select_replication_lag();
+        double lag_seconds = std::numeric_limits<double>::max();
+        try {
+            session.exec_with_result_output(*cmd, [&](const PGresult *pg_result) {
+                if (PQntuples(pg_result) == 1  &&  ! PQgetisnull(pg_result, 0, 0)) {
+                    const uint64_t bits = read_big_endian<uint64_t>(PQgetvalue(pg_result, 0, 0));
+                    memcpy(&lag_seconds, &bits, sizeof(lag_seconds));
+                }
+            });
+        }
+        catch (...) {
+            if (! session.is_alive())  throw;  // so try_read() takes the replica out of service
+            // Otherwise the server can't tell us (e.g. because it's too old), so assume the worst.
+        }
+        r._lag_us = static_cast<int64_t>(std::min(lag_seconds * 1e6, 1e15));
+        r._lag_measured = now;
+    }
+    return r._lag_us <= _max_lag.count();
+}
+
+}
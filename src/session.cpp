@@ -4,9 +4,19 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <list>
+#include <map>
 #include <queue>
+#include <set>
 #include <string>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 #include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
@@ -16,9 +26,13 @@
 #include <quince/exceptions.h>
 #include <quince/detail/row.h>
 #include <quince/detail/util.h>
+#include <quince_postgresql/column_batch.h>
 #include <quince_postgresql/database.h>
+#include <quince_postgresql/detail/binary_format.h>
 #include <quince_postgresql/detail/dialect_sql.h>
+#include <quince_postgresql/detail/poll.h>
 #include <quince_postgresql/detail/session.h>
+#include <quince_postgresql/detail/type_oids.h>
 
 using boost::format;
 using boost::optional;
@@ -27,66 +41,24 @@ using std::dynamic_pointer_cast;
 using std::shared_ptr;
 using std::string;
 using std::stringstream;
+using std::to_string;
 using std::unique_ptr;
 using std::vector;
 
 
-#define BOOLOID 16
-#define BYTEAOID 17
-#define INT8OID 20
-#define INT2OID 21
-#define INT4OID 23
-#define TEXTOID 25
-#define OIDOID 26
-#define FLOAT4OID 700
-#define FLOAT8OID 701
-#define TIMESTAMPOID 1114
-#define VOIDOID 2278
-#define TSVECTOROID 3614
-#define UNKNOWNOID 705
-
-
 namespace quince_postgresql {
 
 namespace {
-    Oid
-    standard_type_oid(column_type type) {
-        switch (type) {
-            case column_type::boolean:          return BOOLOID;
-            case column_type::small_int:        return INT2OID;
-            case column_type::integer:          return INT4OID;
-            case column_type::big_int:          return INT8OID;
-            case column_type::floating_point:   return FLOAT4OID;
-            case column_type::double_precision: return FLOAT8OID;
-            case column_type::timestamp:        return TIMESTAMPOID;
-            case column_type::string:           return TEXTOID;
-            case column_type::byte_vector:      return BYTEAOID;
-            case column_type::none:             return VOIDOID;
-            default:                            abort();
-        }
-    }
-
-    column_type
-    get_column_type(Oid type_oid)  {
-        switch (type_oid) {
-            case BOOLOID:       return column_type::boolean;
-            case INT2OID:       return column_type::small_int;
-            case INT4OID:       return column_type::integer;
-            case INT8OID:       return column_type::big_int;
-            case FLOAT4OID:     return column_type::floating_point;
-            case FLOAT8OID:     return column_type::double_precision;
-            case TIMESTAMPOID:  return column_type::timestamp;
-            case TEXTOID:       return column_type::string;
-            case BYTEAOID:      return column_type::byte_vector;
-            case VOIDOID:       return column_type::none;
-            default:            throw retrieved_unrecognized_type_exception(type_oid);
-        }
-    }
-
-
     class exec_params {
     public:
-        explicit exec_params(const vector<cell> &data) :
+        explicit exec_params(const sql &cmd) :
+            exec_params(
+                cmd.get_input().values(),
+                dynamic_cast<const dialect_sql &>(cmd).parameter_type_overrides()
+            )
+        {}
+
+        exec_params(const vector<cell> &data, const std::map<size_t, Oid> &type_overrides) :
             _n_params(data.size()),
             _types(new Oid[_n_params]),
             _values(new const char *[_n_params]),
@@ -101,7 +73,8 @@ namespace {
                     _lengths[i] = 0;
                 }
                 else {
-                    _types[i] = standard_type_oid(c.type());
+                    const auto overridden = type_overrides.find(i);
+                    _types[i] = overridden == type_overrides.end()  ?  standard_type_oid(c.type())  :  overridden->second;
                     _values[i] = static_cast<const char *>(c.data());
                     _lengths[i] = boost::numeric_cast<int>(c.size());
                 }
@@ -109,9 +82,9 @@ namespace {
             }
         }
 
-        PGresult *
-        exec(PGconn * const conn, const string &sql) const {
-            return PQexecParams(
+        int
+        send(PGconn * const conn, const string &sql) const {
+            return PQsendQueryParams(
                 conn,
                 sql.c_str(),
                 boost::numeric_cast<int>(_n_params),
@@ -121,15 +94,14 @@ namespace {
                 _formats.get(),
                 1
             );
-        };
+        }
 
         int
-        send(PGconn * const conn, const string &sql) const {
-            return PQsendQueryParams(
+        send_prepared(PGconn * const conn, const string &statement_name) const {
+            return PQsendQueryPrepared(
                 conn,
-                sql.c_str(),
+                statement_name.c_str(),
                 boost::numeric_cast<int>(_n_params),
-                _types.get(),
                 _values.get(),
                 _lengths.get(),
                 _formats.get(),
@@ -137,6 +109,9 @@ namespace {
             );
         }
 
+        int     n_params() const    { return boost::numeric_cast<int>(_n_params); }
+        const Oid *types() const    { return _types.get(); }
+
     private:
         const size_t _n_params;
         std::unique_ptr<Oid[]> _types;
@@ -145,47 +120,119 @@ namespace {
         const std::unique_ptr<int[]> _formats;
     };
 
-    string
-    new_cursor_name() {
-        static uint64_t count = 0;
-        return "cursor_" + std::to_string(count++);
+    // True if text is a statement that rolls back a transaction, or to a savepoint (as when a
+    // nested quince::transaction fails).
+    //
+    bool
+    rolls_back(const string &text) {
+        return text.compare(0, 8, "ROLLBACK") == 0
+            || text.compare(0, 5, "ABORT") == 0;
+    }
+
+    // True if text is a statement that ends a transaction, or starts or ends a savepoint.
+    //
+    bool
+    is_transaction_boundary(const string &text) {
+        return rolls_back(text)
+            || text.compare(0, 6, "COMMIT") == 0
+            || text.compare(0, 3, "END") == 0
+            || text.compare(0, 9, "SAVEPOINT") == 0
+            || text.compare(0, 7, "RELEASE") == 0;
+    }
+
+    // True if text is a statement that may change tables' columns.
+    //
+    bool
+    is_ddl(const string &text) {
+        return text.compare(0, 7, "CREATE ") == 0
+            || text.compare(0, 6, "ALTER ") == 0
+            || text.compare(0, 5, "DROP ") == 0;
     }
 
+    // True if exec_result shows that the server no longer has a usable version of the prepared
+    // statement that we executed, e.g. because of DEALLOCATE ALL, or DDL that changed its result type.
+    //
+    bool
+    invalidates_prepared_statement(const PGresult *exec_result) {
+        if (PQresultStatus(exec_result) != PGRES_FATAL_ERROR)  return false;
+
+        const char *const sqlstate = PQresultErrorField(exec_result, PG_DIAG_SQLSTATE);
+        return sqlstate != nullptr
+            && (string(sqlstate) == "26000"     // invalid_sql_statement_name
+            ||  string(sqlstate) == "0A000");   // feature_not_supported, as in "cached plan must not change result type"
+    }
+
+    // What query_result needs to know about a column, worked out once per result rather
+    // than once per cell.
+    //
+    struct column_descriptor {
+        column_descriptor() : _type_oid(InvalidOid), _binary(false)  {}
+
+        string _name;
+        Oid _type_oid;
+        bool _binary;
+        optional<column_type> _type;    // resolved from _type_oid on first use
+    };
+
     class query_result {
     public:
         explicit query_result(const database &database, PGresult *pg_result) :
             _database(database),
-            _pg_result(pg_result),
-            _n_rows(boost::numeric_cast<uint32_t>(PQntuples(pg_result))),
-            _n_cols(boost::numeric_cast<uint32_t>(PQnfields(pg_result))),
-            _col_names(new string[_n_cols]),
-            _type_oids(new Oid[_n_cols]),
-            _current_row(0)
+            _pg_result(nullptr),
+            _n_cols(0)
         {
-            for (uint32_t i = 0; i < _n_cols; i++) {
-                const char *chars = PQfname(_pg_result, i);
-                if (chars == NULL)  throw malformed_results_exception();
-                _col_names[i] = chars;
-                _type_oids[i] = PQftype(_pg_result, i);
-            }
+            reset(pg_result);
         }
 
         ~query_result() {
             if (_pg_result != NULL)  PQclear(_pg_result);
         }
 
+        // Move on to a new PGresult (e.g. the next batch of a stream), recycling the storage
+        // that describes the columns rather than allocating it afresh.  If the caller knows that
+        // pg_result has the same columns as the previous one (as all batches from one cursor do),
+        // then the descriptors, and their resolved types, are kept as they are.
+        //
+        void
+        reset(PGresult *pg_result, bool same_shape = false) {
+            if (_pg_result != NULL)  PQclear(_pg_result);
+            _pg_result = pg_result;
+            _n_rows = boost::numeric_cast<uint32_t>(PQntuples(pg_result));
+            _current_row = 0;
+
+            const uint32_t n_cols = boost::numeric_cast<uint32_t>(PQnfields(pg_result));
+            if (same_shape  &&  n_cols == _n_cols) {
+                assert(_n_cols == 0  ||  PQftype(_pg_result, 0) == _columns[0]._type_oid);
+                return;
+            }
+            _n_cols = n_cols;
+            _columns.resize(_n_cols);
+            for (uint32_t i = 0; i < _n_cols; i++) {
+                const char *chars = PQfname(_pg_result, i);
+                if (chars == NULL)  throw malformed_results_exception();
+
+                column_descriptor &col = _columns[i];
+                const Oid type_oid = PQftype(_pg_result, i);
+                if (col._type_oid != type_oid)  col._type = boost::none;
+                col._name.assign(chars);
+                col._type_oid = type_oid;
+                col._binary = PQfformat(_pg_result, i) == 1;
+            }
+        }
+
         vector<string>
-        metadata() const {
+        metadata() {
             vector<string> result;
             result.reserve(_n_cols);
-            for (uint32_t i = 0; i < _n_cols; i++) {
-                const string &col_name = _col_names[i];
-                const string type_name = _database.column_type_name(get_column_type(_type_oids[i]));
-                result.push_back((format("\"%1%\" %2%") % col_name % type_name).str());
+            for (column_descriptor &col: _columns) {
+                const string type_name = _database.column_type_name(resolved_type(col));
+                result.push_back((format("\"%1%\" %2%") % col._name % type_name).str());
             }
             return result;
         }
     
+        const PGresult *get() const  { return _pg_result; }
+
         bool
         bad_no_data() const {
             return PQresultStatus(_pg_result) != PGRES_COMMAND_OK;
@@ -208,52 +255,334 @@ namespace {
             unique_ptr<row> result = quince::make_unique<row>(&_database);
 
             for (uint32_t i = 0; i < _n_cols; i++) {
+                column_descriptor &col = _columns[i];
                 const optional<column_type> col_type(
                     ! PQgetisnull(_pg_result, _current_row, i),
-                    get_column_type(_type_oids[i])
+                    resolved_type(col)
                 );
-                const cell cell(
+                cell cell(
                     col_type,
-                    PQfformat(_pg_result, i) == 1,
+                    col._binary,
                     PQgetvalue(_pg_result, _current_row, i),
                     boost::numeric_cast<size_t>(PQgetlength(_pg_result, _current_row, i))
                 );
-                result->add_cell(cell, _col_names[i]);
+                result->add_cell(std::move(cell), col._name);
             }
             _current_row++;
             return result;
         }
 
     private:
+        static column_type
+        resolved_type(column_descriptor &col) {
+            if (! col._type)  col._type = get_column_type(col._type_oid);
+            return *col._type;
+        }
+
         const database &_database;
-        PGresult *const _pg_result;
-        const uint32_t _n_rows;
-        const uint32_t _n_cols;
-        std::unique_ptr<string[]> _col_names;
-        std::unique_ptr<Oid[]> _type_oids;
+        PGresult *_pg_result;
+        uint32_t _n_rows;
+        uint32_t _n_cols;
+        vector<column_descriptor> _columns;
         uint32_t _current_row;
     };
 }
 
-class session_impl::result_stream_impl : public abstract_result_stream_impl {
+namespace {
+    typedef std::chrono::steady_clock clock_type;
+
+    // How long to wait for a connection to conn's server: libpq's connect_timeout (from the
+    // connection string or PGCONNECT_TIMEOUT, and at least 2 seconds, as libpq has it), or else
+    // a default, because waiting forever for an unreachable server would hang the pool's callers.
+    //
+    std::chrono::seconds
+    connect_timeout(PGconn *conn) {
+        std::chrono::seconds result(30);
+        if (PQconninfoOption *const options = PQconninfo(conn)) {
+            for (const PQconninfoOption *o = options; o->keyword; o++)
+                if (string(o->keyword) == "connect_timeout"  &&  o->val) {
+                    const int seconds = atoi(o->val);
+                    if (seconds > 0)  result = std::chrono::seconds(std::max(seconds, 2));
+                }
+            PQconninfoFree(options);
+        }
+        return result;
+    }
+
+    // The amount of column data in a result, as received.
+    //
+    uint64_t
+    result_bytes(const PGresult *result) {
+        uint64_t total = 0;
+        const int n_rows = PQntuples(result);
+        const int n_cols = PQnfields(result);
+        for (int r = 0; r < n_rows; r++)
+            for (int c = 0; c < n_cols; c++)
+                total += PQgetlength(result, r, c);
+        return total;
+    }
+
+    // Chooses the number of rows for each FETCH of a stream.  With no memory budget, that's
+    // just the initial size.  Otherwise it aims for batches that take about target_latency to
+    // arrive, doubling or halving as necessary, but never so many rows that the batches held
+    // at once (the one being consumed plus those prefetched) would exceed the budget.
+    //
+    // Sizes are kept to powers of 2, so that there are few distinct FETCH commands to prepare.
+    //
+    class adaptive_fetch_size {
+    public:
+        adaptive_fetch_size(uint32_t initial, size_t memory_budget, uint32_t max_batches_held) :
+            _memory_budget(memory_budget),
+            _max_batches_held(std::max<uint32_t>(max_batches_held, 1)),
+            _bytes_per_row(0),
+            _current(memory_budget == 0 ? initial : round_down_to_power_of_2(initial))
+        {}
+
+        uint32_t current() const  { return _current; }
+
+        void
+        observe(const PGresult *batch, clock_type::duration latency) {
+            if (_memory_budget == 0)  return;
+
+            const double sampled = sample_bytes_per_row(batch);
+            _bytes_per_row = _bytes_per_row == 0  ?  sampled  :  (3*_bytes_per_row + sampled) / 4;
+
+            static const clock_type::duration target_latency = std::chrono::milliseconds(100);
+            uint64_t proposed = _current;
+            if (latency < target_latency/2)         proposed *= 2;
+            else if (latency > target_latency*2)    proposed /= 2;
+
+            const double affordable = _memory_budget / (_max_batches_held * std::max(_bytes_per_row, 1.0));
+            proposed = std::min<uint64_t>(proposed, static_cast<uint64_t>(affordable));
+            proposed = std::min<uint64_t>(proposed, 1 << 20);
+            _current = round_down_to_power_of_2(static_cast<uint32_t>(std::max<uint64_t>(proposed, 1)));
+        }
+
+    private:
+        static uint32_t
+        round_down_to_power_of_2(uint32_t n) {
+            uint32_t result = 1;
+            while (result <= n/2)  result *= 2;
+            return result;
+        }
+
+        // Estimated memory per row, from a sample of up to 8 rows, including a rough
+        // allowance for per-cell overhead.
+        //
+        static double
+        sample_bytes_per_row(const PGresult *batch) {
+            const int n_rows = PQntuples(batch);
+            const int n_cols = PQnfields(batch);
+            const int n_samples = std::min(n_rows, 8);
+            if (n_samples == 0)  return 0;
+
+            uint64_t total = 0;
+            for (int s = 0; s < n_samples; s++) {
+                const int r = s * n_rows / n_samples;
+                for (int c = 0; c < n_cols; c++)
+                    total += PQgetlength(batch, r, c) + 32;
+            }
+            return static_cast<double>(total) / n_samples;
+        }
+
+        const size_t _memory_budget;
+        const uint32_t _max_batches_held;
+        double _bytes_per_row;
+        uint32_t _current;
+    };
+}
+
+// A least-recently-used map from (SQL text, parameter types) to the names of statements
+// that this session has prepared on the server.
+//
+class session_impl::statement_cache {
+public:
+    explicit statement_cache(size_t capacity) :
+        _capacity(capacity),
+        _next_serial(0)
+    {}
+
+    bool
+    enabled() const {
+        return _capacity != 0;
+    }
+
+    static string
+    key(const string &text, int n_params, const Oid *types) {
+        string result = text;
+        result.push_back('\0');
+        result.append(reinterpret_cast<const char *>(types), n_params * sizeof(Oid));
+        return result;
+    }
+
+    const string *
+    find(const string &key) {
+        const auto found = _index.find(key);
+        if (found == _index.end())  return nullptr;
+
+        _entries.splice(_entries.begin(), _entries, found->second);
+        return &found->second->_name;
+    }
+
+    // If the cache is full, forget its least recently used statement, and return that
+    // statement's name, so the caller can deallocate it.
+    //
+    optional<string>
+    make_room() {
+        if (_entries.size() < _capacity)  return boost::none;
+
+        const string victim = _entries.back()._name;
+        _index.erase(_entries.back()._key);
+        _entries.pop_back();
+        return victim;
+    }
+
+    string
+    next_name() {
+        return "quince_stmt_" + to_string(_next_serial++);
+    }
+
+    const string &
+    insert(const string &key, const string &name) {
+        assert(_entries.size() < _capacity);
+        _entries.push_front({key, name});
+        _index[key] = _entries.begin();
+        return _entries.front()._name;
+    }
+
+    // Return true if the statement was in the cache.
+    //
+    bool
+    forget(const string &name) {
+        const auto found = std::find_if(
+            _entries.begin(),
+            _entries.end(),
+            [&](const entry &e) { return e._name == name; }
+        );
+        if (found == _entries.end())  return false;
+
+        _index.erase(found->_key);
+        _entries.erase(found);
+        return true;
+    }
+
+    // Forget every statement, and return their names, so the caller can deallocate them.
+    //
+    vector<string>
+    clear() {
+        vector<string> result;
+        for (const entry &e: _entries)  result.push_back(e._name);
+        _entries.clear();
+        _index.clear();
+        return result;
+    }
+
+private:
+    struct entry {
+        string _key;
+        string _name;
+    };
+
+    const size_t _capacity;
+    uint64_t _next_serial;
+    std::list<entry> _entries;  // most recently used first
+    std::unordered_map<string, std::list<entry>::iterator> _index;
+};
+
+
+// Completes the trace that pq_exec() started, and reports it, once the result has been
+// decoded, or has failed to be.  The trace counts as failed unless succeeded() is called
+// first.
+//
+class session_impl::trace_reporter : private boost::noncopyable {
+public:
+    explicit trace_reporter(session_impl &session) :
+        _session(session),
+        _succeeded(false)
+    {}
+
+    ~trace_reporter() {
+        if (! _session._pending_trace)  return;
+
+        statement_trace &trace = *_session._pending_trace;
+        trace._decode_time = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - _session._decode_start);
+        if (! _succeeded)  trace._succeeded = false;
+        try {
+            _session._tracing->report(trace);
+        }
+        catch (...) {}
+        _session._pending_trace = boost::none;
+    }
+
+    void succeeded()  { _succeeded = true; }
+
+private:
+    session_impl &_session;
+    bool _succeeded;
+};
+
+
+// What the session needs from a stream, however it gets its rows.
+//
+class session_impl::stream_impl : public abstract_result_stream_impl {
+public:
+    explicit stream_impl(const session_impl &owner) :
+        _owner(owner)
+    {}
+
+    const session_impl &owner() const  { return _owner; }
+
+    virtual unique_ptr<row> next() = 0;
+
+    // Finish reading whatever the server has been asked for, so the connection is free for
+    // other commands.
+    //
+    virtual void absorb() = 0;
+
+    // The owner is being dropped without its database (see session_impl::abandon()), so forget
+    // whatever is still coming from the server, and leave the connection alone from now on.
+    //
+    virtual void abandon() = 0;
+
+private:
+    const session_impl &_owner;
+};
+
+
+class session_impl::result_stream_impl : public session_impl::stream_impl {
 public:
     result_stream_impl(
+        const session_impl &owner,
         const database &database,
         const string &cursor_name,
         PGconn *conn,
         uint32_t fetch_size,
+        uint32_t prefetch_depth,
+        size_t memory_budget,
+        const std::shared_ptr<statement_tracing> &tracing,
         const std::function<int(const sql &)> send,
+        const std::function<PGresult *(void)> get_result,
+        const std::function<void(const string &)> fail,
         const std::function<void(void)> epilogue
         ) :
+        stream_impl(owner),
         _database(database),
-        _sql_fetch(database.make_dialect_sql()),
+        _cursor_name(cursor_name),
         _conn(conn),
+        _fetch_size(fetch_size, memory_budget, prefetch_depth + 1),
+        _prefetch_depth(prefetch_depth),
+        _tracing(tracing),
         _send(send),
+        _get_result(get_result),
+        _fail(fail),
         _epilogue(epilogue),
-        _current(quince::make_unique<query_result>(_database, fetch())),
-        _exhausted(false)
+        _pipelined(false),
+        _cursor_exhausted(false),
+        _exhausted(false),
+        _abandoned(false),
+        _rows_since_readiness_check(0)
     {
-        const_cast<dialect_sql &>(*_sql_fetch).write_fetch(cursor_name, fetch_size);
+        send_fetch();
     }
 
     ~result_stream_impl() {
@@ -265,47 +594,208 @@ public:
 
     void
     close() {
+        absorb();
         while (!_backlog.empty())  PQclear(take_from_backlog());
-        _epilogue();
+        if (! _abandoned)  _epilogue();
     }
 
-    void
-    absorb() {
-        while (PGresult *r = PQgetResult(_conn))  _backlog.push(r);
+    virtual void
+    absorb() override {
+        while (! _in_flight.empty())  collect();
+        leave_pipeline();
+    }
+
+    // What's in flight goes with the connection, and so does the cursor, so no CLOSE.
+    //
+    virtual void
+    abandon() override {
+        while (! _in_flight.empty())  _in_flight.pop();
+        _pipelined = false;
+        _cursor_exhausted = true;
+        _abandoned = true;
     }
 
-    unique_ptr<row>
-    next() {
+    virtual unique_ptr<row>
+    next() override {
+        // Looking every so often, rather than at every row, since each look is a system call.
+        //
+        static const uint32_t readiness_check_interval = 64;
+
         unique_ptr<row> result;
         for (;;) {
             if (_exhausted)
                 return nullptr;
             else if (result)
                 return result;
-            else if (_current && !_current->at_end())
+            else if (_current && !_current->at_end()) {
                 result = _current->next();
-            else if (! _backlog.empty())
-                _current = quince::make_unique<query_result>(_database, take_from_backlog());
-            else if (PGresult *gotten = PQgetResult(_conn))
-                _backlog.push(gotten);
-            else if (PGresult *fetched = fetch())
-                _backlog.push(fetched);
+                if (++_rows_since_readiness_check == readiness_check_interval) {
+                    note_readiness();
+                    _rows_since_readiness_check = 0;
+                }
+            }
+            else if (! _backlog.empty()) {
+                if (_current)
+                    _current->reset(take_from_backlog(), true);  // a cursor's batches all have the same columns
+                else
+                    _current = quince::make_unique<query_result>(_database, take_from_backlog());
+                prefetch();  // so the server and the network work on the next batch while we decode this one
+            }
+            else if (! _in_flight.empty())
+                collect();
+            else if (! _cursor_exhausted)
+                send_fetch();
+            else
+                _exhausted = true;
+        }
+    }
+
+    // Decode the next batch of rows straight into dest, without making a row for each.
+    // Returns false if there are no more.  (Don't mix this with next() on the same stream.)
+    //
+    bool
+    next_batch(column_batch &dest) {
+        note_readiness();
+        for (;;) {
+            if (_exhausted)
+                return false;
+            else if (! _backlog.empty()) {
+                if (_current)
+                    _current->reset(take_from_backlog(), true);
+                else
+                    _current = quince::make_unique<query_result>(_database, take_from_backlog());
+                prefetch();
+                dest.assign(_current->get());
+                return true;
+            }
+            else if (! _in_flight.empty())
+                collect();
+            else if (! _cursor_exhausted)
+                send_fetch();
             else
                 _exhausted = true;
         }
     }
 
 private:
-    PGresult *
-    fetch() {
+    void
+    prefetch() {
+        if (_cursor_exhausted)  return;
+
+        if (_prefetch_depth > 1  &&  enter_pipeline())
+            while (_in_flight.size() < _prefetch_depth)  send_fetch();
+        else if (_prefetch_depth == 1  &&  _in_flight.empty())
+            send_fetch();
+    }
+
+    void
+    send_fetch() {
+        const uint32_t n_rows = _fetch_size.current();
+        if (! _sql_fetch  ||  n_rows != _sql_fetch_rows) {
+            const std::shared_ptr<dialect_sql> sql_fetch = _database.make_dialect_sql();
+            sql_fetch->write_fetch(_cursor_name, n_rows);
+            _sql_fetch = sql_fetch;
+            _sql_fetch_rows = n_rows;
+        }
+
+        const clock_type::time_point start = clock_type::now();
         _send(*_sql_fetch);
-        while (PGresult * const r = PQgetResult(_conn)) {
+#ifdef LIBPQ_HAS_PIPELINING
+        if (_pipelined)  PQpipelineSync(_conn);
+#endif
+        const clock_type::time_point sent = clock_type::now();
+        _in_flight.push({ n_rows, sent, sent - start, _sql_fetch, boost::none });
+    }
+
+    // If the oldest FETCH in flight has its results ready to read, and we hadn't noticed
+    // before, note the time.  So its latency, as the fetch size adapts to it, excludes the time
+    // we spent on other things (e.g. the consumer's work on earlier rows) after it was ready.
+    // Doesn't wait.
+    //
+    void
+    note_readiness() {
+        if (_in_flight.empty()  ||  _in_flight.front()._ready)  return;
+        if (PQconsumeInput(_conn)  &&  ! PQisBusy(_conn))  _in_flight.front()._ready = clock_type::now();
+    }
+
+    // Move the results of the oldest FETCH in flight to the backlog.
+    //
+    void
+    collect() {
+        assert(! _in_flight.empty());
+        note_readiness();  // if it's not ready now, then it will be when the first result arrives
+        const in_flight_fetch fetch = _in_flight.front();
+        optional<clock_type::time_point> ready = fetch._ready;
+        const bool tracing = _tracing->enabled();
+        bool full_batch = false;
+        optional<string> error;
+        uint64_t n_rows = 0;
+        uint64_t n_bytes = 0;
+        while (PGresult * const r = _get_result()) {
+            if (! ready)  ready = clock_type::now();
+            const ExecStatusType status = PQresultStatus(r);
+            if (status != PGRES_TUPLES_OK  &&  status != PGRES_COMMAND_OK  &&  ! error) {
+                const char *const message = PQresultErrorMessage(r);
+                error = string(message ? message : "");
+            }
+            if (tracing) {
+                n_rows += boost::numeric_cast<uint64_t>(PQntuples(r));
+                n_bytes += result_bytes(r);
+            }
             if (PQntuples(r) == 0)
                 PQclear(r);
-            else
-                return r;
+            else {
+                full_batch = PQntuples(r) >= boost::numeric_cast<int>(fetch._n_rows);
+                _fetch_size.observe(r, *ready - fetch._sent);
+                _backlog.push(r);
+            }
         }
-        return nullptr;
+        if (! full_batch)  _cursor_exhausted = true;  // so there's no point fetching any further
+        if (tracing)
+            _tracing->report(statement_trace{
+                fetch._sql->get_text(),
+                0,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(fetch._send_time),
+                std::chrono::duration_cast<std::chrono::nanoseconds>((ready ? *ready : clock_type::now()) - fetch._sent),
+                std::chrono::nanoseconds(0),
+                n_rows,
+                n_bytes,
+                ! error
+            });
+
+#ifdef LIBPQ_HAS_PIPELINING
+        if (_pipelined)
+            while (PGresult * const r = _get_result()) {
+                const bool synced = PQresultStatus(r) == PGRES_PIPELINE_SYNC;
+                PQclear(r);
+                if (synced)  break;
+            }
+#endif
+        _in_flight.pop();
+        if (_cursor_exhausted  &&  _in_flight.empty())  leave_pipeline();
+        if (error)  _fail(*error);
+    }
+
+    // Pipeline mode lets us have more than one FETCH in flight.  We can only enter it when
+    // none are.
+    //
+    bool
+    enter_pipeline() {
+#ifdef LIBPQ_HAS_PIPELINING
+        if (! _pipelined  &&  _in_flight.empty())
+            _pipelined = PQenterPipelineMode(_conn) == 1;
+#endif
+        return _pipelined;
+    }
+
+    void
+    leave_pipeline() {
+#ifdef LIBPQ_HAS_PIPELINING
+        if (_pipelined  &&  _in_flight.empty()) {
+            PQexitPipelineMode(_conn);
+            _pipelined = false;
+        }
+#endif
     }
 
     PGresult *
@@ -315,17 +805,133 @@ private:
         return result;
     }
 
+    struct in_flight_fetch {
+        uint32_t _n_rows;
+        clock_type::time_point _sent;
+        clock_type::duration _send_time;
+        std::shared_ptr<const dialect_sql> _sql;
+        optional<clock_type::time_point> _ready;   // when we first saw its results ready to read
+    };
+
     const database &_database;
-    unique_ptr<const dialect_sql> _sql_fetch;
+    const string _cursor_name;
+    std::shared_ptr<const dialect_sql> _sql_fetch;
+    uint32_t _sql_fetch_rows;
     PGconn * const _conn;
+    adaptive_fetch_size _fetch_size;
+    const uint32_t _prefetch_depth;     // max number of FETCHes in flight while we work on a batch
+    const std::shared_ptr<statement_tracing> _tracing;
     const std::function<int(const sql &)> _send;
+    const std::function<PGresult *(void)> _get_result;
+    const std::function<void(const string &)> _fail;     // throws
     const std::function<void(void)> _epilogue;
     unique_ptr<query_result> _current;
-    bool _exhausted;
+    std::queue<in_flight_fetch> _in_flight;     // FETCHes sent whose results aren't yet in _backlog
+    bool _pipelined;
+    bool _cursor_exhausted;             // the server has nothing more to give us
+    bool _exhausted;                    // and neither has _backlog
+    bool _abandoned;                    // by the session, so the epilogue is not to be run
+    uint32_t _rows_since_readiness_check;
     std::queue<PGresult *> _backlog;
 };
 
 
+// Reads the rows of a single query as the server sends them, in single-row mode (or, with
+// a libpq that has it, chunked-rows mode).
+//
+class session_impl::single_row_stream_impl : public session_impl::stream_impl {
+public:
+    single_row_stream_impl(
+        const session_impl &owner,
+        const database &database,
+        const std::function<PGresult *(void)> get_result,
+        const std::function<void(const string &)> fail
+    ) :
+        stream_impl(owner),
+        _database(database),
+        _get_result(get_result),
+        _fail(fail),
+        _finished(false)
+    {}
+
+    ~single_row_stream_impl() {
+        try {
+            absorb();
+        }
+        catch (...) {}
+        while (! _backlog.empty()) {
+            PQclear(_backlog.front());
+            _backlog.pop();
+        }
+    }
+
+    // Reading the rest of the rows is the only way to end the query without aborting the
+    // transaction (if any), so that's what we do.
+    //
+    virtual void
+    absorb() override {
+        while (PGresult *const r = receive())  _backlog.push(r);
+    }
+
+    virtual void
+    abandon() override {
+        _finished = true;
+    }
+
+    virtual unique_ptr<row>
+    next() override {
+        for (;;) {
+            if (_current  &&  ! _current->at_end())  return _current->next();
+
+            PGresult *r;
+            if (! _backlog.empty()) {
+                r = _backlog.front();
+                _backlog.pop();
+            }
+            else if ((r = receive()) == nullptr)
+                return nullptr;
+
+            if (_current)
+                _current->reset(r, true);  // every result of the query has the same columns
+            else
+                _current = quince::make_unique<query_result>(_database, r);
+        }
+    }
+
+private:
+    // The next result from the server, or null when there are no more.  Errors are thrown,
+    // but only once the query's results are all read, so the connection is left usable.
+    //
+    PGresult *
+    receive() {
+        if (_finished)  return nullptr;
+
+        optional<string> error;
+        while (PGresult *const r = _get_result()) {
+            const ExecStatusType status = PQresultStatus(r);
+            if (! error  &&  status != PGRES_FATAL_ERROR  &&  status != PGRES_BAD_RESPONSE)
+                return r;
+
+            if (! error) {
+                const char *const message = PQresultErrorMessage(r);
+                error = string(message ? message : "");
+            }
+            PQclear(r);
+        }
+        _finished = true;
+        if (error)  _fail(*error);
+        return nullptr;
+    }
+
+    const database &_database;
+    const std::function<PGresult *(void)> _get_result;
+    const std::function<void(const string &)> _fail;     // throws
+    unique_ptr<query_result> _current;
+    std::queue<PGresult *> _backlog;    // received by absorb(), not yet read by next()
+    bool _finished;                     // all results have been received
+};
+
+
 string
 session_impl::spec::connection_string() const {
     stringstream strm;
@@ -341,17 +947,37 @@ extern "C" {
     void ignore_postgresql_notice(void *a_arg, const PGresult *a_res)  {}
 }
 
-session_impl::session_impl(const database &database, const session_impl::spec &spec) :
+session_impl::session_impl(const database &database, const session_impl::spec &spec, PGconn *conn) :
     _database(database),
-    _conn(connect(spec))
+    _conn(conn),
+    _statement_cache(quince::make_unique<statement_cache>(spec._statement_cache_capacity)),
+    _stream_prefetch_depth(spec._stream_prefetch_depth),
+    _stream_memory_budget(spec._stream_memory_budget),
+    _tracing(spec._tracing),
+    _statement_timeout(spec._statement_timeout),
+    _stream_mode(spec._stream_mode),
+    _cancelled(false),
+    _next_cursor_serial(0),
+    _default_notice_receiver(_conn ? PQsetNoticeReceiver(_conn, nullptr, nullptr) : nullptr),
+    _pipelining(false),
+    _awaiting_async(false),
+    _was_in_transaction(false),
+    _transaction_serial(0)
 {
-    if (! _conn  ||  PQstatus(_conn) != CONNECTION_OK)
+    if (! _conn  ||  PQstatus(_conn) != CONNECTION_OK) {
+        if (_conn)  disconnect(_conn);
         throw failed_connection_exception();
+    }
     if (spec._isolation) {
         unique_ptr<dialect_sql> cmd = _database.make_dialect_sql();
         cmd->write_set_session_characteristics(*spec._isolation);
         exec(*cmd);
     }
+    if (spec._default_schema) {
+        unique_ptr<dialect_sql> cmd = _database.make_dialect_sql();
+        cmd->write_set_search_path(*spec._default_schema);
+        exec(*cmd);
+    }
 }
 
 session_impl::~session_impl() {
@@ -359,49 +985,220 @@ session_impl::~session_impl() {
     if (_conn)  disconnect(_conn);
 }
 
+void
+session_impl::abandon() {
+    if (_asynchronous_stream) {
+        _asynchronous_stream->abandon();
+        _asynchronous_stream.reset();
+    }
+}
+
 void
 session_impl::ignore_notices() {
+    finish_pipeline();
     absorb_pending_results();
     PQsetNoticeReceiver(_conn, ignore_postgresql_notice, nullptr);
 }
 
 bool
 session_impl::unchecked_exec(const sql &cmd) {
+    finish_pipeline();
     assert(! _asynchronous_stream);
-    return ! query_result(_database, pq_exec(cmd)).bad_no_data();
+    trace_reporter reporter(*this);
+    const bool result = ! query_result(_database, pq_exec(cmd)).bad_no_data();
+    reporter.succeeded();
+    return result;
 }
 
 unique_ptr<row>
 session_impl::exec_with_one_output(const sql &cmd) {
+    finish_pipeline();
     absorb_pending_results();
     return one_output(pq_exec(cmd));
 }
 
+vector<unique_ptr<row>>
+session_impl::exec_with_all_output(const sql &cmd) {
+    finish_pipeline();
+    absorb_pending_results();
+    return all_output(pq_exec(cmd));
+}
+
 result_stream
 session_impl::exec_with_stream_output(const sql &cmd, uint32_t fetch_size) {
+    finish_pipeline();
     absorb_pending_results();
+
+    if (_stream_mode == stream_mode::single_row)  return exec_with_single_row_output(cmd, fetch_size);
+    return exec_with_cursor_output(cmd, fetch_size);
+}
+
+void
+session_impl::exec_with_result_output(const sql &cmd, const std::function<void(const PGresult *)> &consume) {
+    finish_pipeline();
+    absorb_pending_results();
+
+    const query_result r(_database, pq_exec(cmd));
+    trace_reporter reporter(*this);
+    if (r.bad_data())  throw_last_error();
+    consume(r.get());
+    reporter.succeeded();
+}
+
+void
+session_impl::exec_with_columnar_output(
+    const sql &cmd,
+    uint32_t fetch_size,
+    const std::function<void(const column_batch &)> &consume
+) {
+    finish_pipeline();
+    absorb_pending_results();
+
+    column_batch batch;
+    if (fetch_size == 0) {
+        exec_with_result_output(cmd, [&](const PGresult *pg_result) { batch.assign(pg_result); });
+        consume(batch);
+        return;
+    }
+
+    const shared_ptr<result_stream_impl> rsi =
+        dynamic_pointer_cast<result_stream_impl>(exec_with_cursor_output(cmd, fetch_size));
+    assert(rsi);
+    for (;;) {
+        // consume() may have used the session for something else in the meantime.
+        //
+        if (rsi != _asynchronous_stream) {
+            absorb_pending_results();
+            _asynchronous_stream = rsi;
+        }
+        if (! rsi->next_batch(batch))  break;
+        consume(batch);
+    }
+}
+
+result_stream
+session_impl::exec_with_cursor_output(const sql &cmd, uint32_t fetch_size) {
+    // Inside a transaction the cursor can die with the transaction, which spares the server
+    // from materializing the whole result at commit time, as it must for a WITH HOLD cursor.
+    //
+    note_transaction_status();
+    const optional<uint64_t> declaring_transaction(in_transaction(), _transaction_serial);
+
     const string cursor_name = new_cursor_name();
     const unique_ptr<dialect_sql> declare = clone(dynamic_cast<const dialect_sql &>(cmd));
-    declare->prepend_declare_cursor(cursor_name);
+    declare->prepend_declare_cursor(cursor_name, ! declaring_transaction);
     check_no_output(pq_exec(*declare));
-    return new_result_stream(cursor_name, fetch_size);
+    return new_result_stream(cursor_name, fetch_size, declaring_transaction);
 }
 
 vector<string>
 session_impl::exec_with_metadata_output(const sql &cmd) {
+    finish_pipeline();
+    absorb_pending_results();
     return metadata(pq_exec(cmd));
 }
 
+std::unordered_map<string, vector<string>>
+session_impl::retrieve_schema_column_titles(const optional<string> &schema_name) {
+    finish_pipeline();
+    absorb_pending_results();
+
+    const unique_ptr<dialect_sql> cmd = _database.make_dialect_sql();
+    cmd->write_select_column_catalog(schema_name);
+    const query_result r(_database, pq_exec(*cmd));
+    trace_reporter reporter(*this);
+    if (r.bad_data())  throw_last_error();
+
+    std::unordered_map<string, vector<string>> result;
+    std::set<string> unrecognized;
+    const PGresult *const pg_result = r.get();
+    const int n_rows = PQntuples(pg_result);
+    for (int i = 0; i < n_rows; i++) {
+        const string table(PQgetvalue(pg_result, i, 0), PQgetlength(pg_result, i, 0));
+        const string column(PQgetvalue(pg_result, i, 1), PQgetlength(pg_result, i, 1));
+        const Oid type_oid = static_cast<Oid>(read_big_endian<int64_t>(PQgetvalue(pg_result, i, 2)));
+        try {
+            const string type_name = _database.column_type_name(get_column_type(type_oid));
+            result[table].push_back((format("\"%1%\" %2%") % column % type_name).str());
+        }
+        catch (const retrieved_unrecognized_type_exception &) {
+            unrecognized.insert(table);
+        }
+    }
+    for (const string &table: unrecognized)  result.erase(table);
+    reporter.succeeded();
+    return result;
+}
+
 void
-session_impl::exec(const sql &cmd) {
+session_impl::copy_in(const sql &cmd, const std::function<bool(string &)> &produce) {
+    finish_pipeline();
+    absorb_pending_results();
+    {
+        // Not pq_exec(), because there's nothing to gain from preparing a COPY.
+        //
+        _latest_sql = cmd.get_text();
+        start_statement();
+        PGresult *const started = exec_params(cmd).send(_conn, _latest_sql)  ?  exec_finish()  :  nullptr;
+        const bool ok = PQresultStatus(started) == PGRES_COPY_IN;
+        PQclear(started);
+        if (! ok)  throw_last_error();
+    }
+
+    string chunk;
+    try {
+        for (bool more = true; more; ) {
+            chunk.clear();
+            more = produce(chunk);
+            if (! chunk.empty()
+                && PQputCopyData(_conn, chunk.data(), boost::numeric_cast<int>(chunk.size())) != 1
+            )
+                break;  // PQgetResult() will tell us why
+        }
+    }
+    catch (...) {
+        PQputCopyEnd(_conn, "bulk load abandoned by client");
+        absorb_pending_results();
+        throw;
+    }
+    PQputCopyEnd(_conn, nullptr);
+    check_no_output(get_result());
     absorb_pending_results();
-    check_no_output(pq_exec(cmd));
+}
+
+void
+session_impl::exec(const sql &cmd) {
+    // Transaction and savepoint boundaries are not pipelined, so that the pipeline's errors are
+    // thrown before the caller thinks that a transaction is over, and so that each error is
+    // thrown within the (possibly nested) transaction that it belongs to.
+    //
+    const string &text = cmd.get_text();
+    if (_pipelining  &&  ! is_transaction_boundary(text))
+        send_to_pipeline(cmd);
+    else if (rolls_back(text)) {
+        // The rollback undoes what failed, so it is sent regardless, and the error thrown after.
+        // Otherwise a failure inside a nested transaction would leave the outer one aborted,
+        // and its commit would quietly turn into a rollback.
+        //
+        close_pipeline(false);
+        const optional<std::pair<string, string>> failure = _deferred_error;
+        _deferred_error = boost::none;
+        absorb_pending_results();
+        check_no_output(pq_exec(cmd));
+        if (failure)  throw_error(failure->first, failure->second);
+    }
+    else {
+        finish_pipeline();
+        absorb_pending_results();
+        check_no_output(pq_exec(cmd));
+    }
 }
 
 unique_ptr<row>
 session_impl::next_output(const result_stream &rs) {
+    finish_pipeline();
     assert(rs);
-    shared_ptr<result_stream_impl> rsi = dynamic_pointer_cast<result_stream_impl>(rs);
+    shared_ptr<stream_impl> rsi = dynamic_pointer_cast<stream_impl>(rs);
     assert(rsi);
     if (rsi != _asynchronous_stream) {
         absorb_pending_results();
@@ -416,11 +1213,213 @@ session_impl::encoding() const {
     return PQparameterStatus(_conn, "server_encoding");
 }
 
+bool
+session_impl::is_alive() {
+    if (PQstatus(_conn) != CONNECTION_OK)  return false;
+
+    // A healthy idle connection has nothing for us to read.  One that the server has closed
+    // becomes readable, and then PQconsumeInput() notices the EOF.
+    //
+    vector<socket_poll_item> items(1, make_socket_poll_item(PQsocket(_conn), true, false));
+    const int n_ready = poll_sockets(items, 0);
+    if (n_ready < 0)  return false;
+    if (n_ready > 0  &&  ! PQconsumeInput(_conn))  return false;
+
+    return PQstatus(_conn) == CONNECTION_OK
+        && PQtransactionStatus(_conn) == PQTRANS_IDLE;
+}
+
+bool
+session_impl::reset_for_reuse() {
+    if (_awaiting_async)  return false;
+    try {
+        close_pipeline(true);
+        _deferred_error = boost::none;
+        absorb_pending_results();
+        switch (PQtransactionStatus(_conn)) {
+            case PQTRANS_IDLE:
+                break;
+            case PQTRANS_INTRANS:
+            case PQTRANS_INERROR: {
+                const unique_ptr<dialect_sql> cmd = _database.make_dialect_sql();
+                cmd->write_rollback();
+                exec(*cmd);
+                break;
+            }
+            default:
+                return false;
+        }
+
+        // Cursors declared WITH HOLD outlive transactions, so without this the next user of
+        // the session could inherit some that were never closed.
+        //
+        const unique_ptr<dialect_sql> close_all = _database.make_dialect_sql();
+        close_all->write_close_all_cursors();
+        exec(*close_all);
+        PQsetNoticeReceiver(_conn, _default_notice_receiver, nullptr);
+        return PQstatus(_conn) == CONNECTION_OK;
+    }
+    catch (...) {
+        return false;
+    }
+}
+
+int
+session_impl::socket() const {
+    return PQsocket(_conn);
+}
+
+void
+session_impl::send_async(const sql &cmd) {
+    finish_pipeline();
+    absorb_pending_results();
+    assert(! _awaiting_async);
+
+    if (PQsetnonblocking(_conn, 1) != 0)  throw_last_error();
+    _awaiting_async = true;
+    _async_error = boost::none;
+    if (! pq_send(cmd)) {
+        end_async();
+        throw_last_error();
+    }
+}
+
+bool
+session_impl::flush_async() {
+    const int flushed = PQflush(_conn);
+    if (flushed < 0) {
+        end_async();
+        throw_last_error();
+    }
+    return flushed == 0;
+}
+
+bool
+session_impl::receive_async(vector<unique_ptr<row>> &output) {
+    if (! PQconsumeInput(_conn)) {
+        end_async();
+        throw_last_error();
+    }
+    while (! PQisBusy(_conn)) {
+        PGresult *const result = PQgetResult(_conn);
+        if (result == nullptr) {
+            end_async();
+            note_transaction_status();
+            if (_async_error)  throw_error(*_async_error, _latest_sql);
+            return true;
+        }
+        switch (PQresultStatus(result)) {
+            case PGRES_TUPLES_OK: {
+                vector<unique_ptr<row>> rows = all_output(result);
+                std::move(rows.begin(), rows.end(), std::back_inserter(output));
+                break;
+            }
+            case PGRES_COMMAND_OK:
+                PQclear(result);
+                break;
+            default:
+                if (! _async_error) {
+                    const char *const message = PQresultErrorMessage(result);
+                    _async_error = string(message ? message : "");
+                }
+                PQclear(result);
+        }
+    }
+    return false;
+}
+
+void
+session_impl::end_async() {
+    _awaiting_async = false;
+    PQsetnonblocking(_conn, 0);
+}
+
+void
+session_impl::start_pipeline() {
+    finish_pipeline();
+    absorb_pending_results();
+    if (! in_transaction())  throw no_transaction_exception();
+#ifdef LIBPQ_HAS_PIPELINING
+    if (PQenterPipelineMode(_conn) != 1)  throw_last_error();
+    _pipelining = true;
+#endif
+    // Otherwise this libpq can't pipeline, so exec() just carries on synchronously.
+}
+
+void
+session_impl::finish_pipeline() {
+    close_pipeline(false);
+    if (_deferred_error) {
+        const std::pair<string, string> error = *_deferred_error;
+        _deferred_error = boost::none;
+        throw_error(error.first, error.second);
+    }
+}
+
+void
+session_impl::close_pipeline(bool discard_errors) {
+#ifdef LIBPQ_HAS_PIPELINING
+    if (_pipelining) {
+        _pipelining = false;
+        collect_pipeline_results();
+        PQexitPipelineMode(_conn);
+    }
+#endif
+    if (discard_errors)  _deferred_error = boost::none;
+}
+
+void
+session_impl::send_to_pipeline(const sql &cmd) {
+    // Collect results from time to time, so the server's replies can't pile up indefinitely.
+    //
+    static const size_t max_pipeline_depth = 1000;
+    if (_pipelined_sql.size() == max_pipeline_depth)  collect_pipeline_results();
+
+    if (! pq_send(cmd)) {
+        const string message = PQerrorMessage(_conn);
+        finish_pipeline();  // throws an earlier command's error, if there was one
+        throw_error(message, _latest_sql);
+    }
+    _pipelined_sql.push_back(_latest_sql);
+}
+
+void
+session_impl::collect_pipeline_results() {
+#ifdef LIBPQ_HAS_PIPELINING
+    // Errors are attributed to the command whose result reports them.  Any commands
+    // after that are skipped by the server, and their results just say so.
+    //
+    PQpipelineSync(_conn);
+    for (const string &sql: _pipelined_sql)
+        while (PGresult *const r = PQgetResult(_conn)) {
+            if (PQresultStatus(r) == PGRES_FATAL_ERROR  &&  ! _deferred_error)
+                _deferred_error = std::make_pair(string(PQresultErrorMessage(r)), sql);
+            PQclear(r);
+        }
+
+    while (PGresult *const r = PQgetResult(_conn)) {
+        const bool synced = PQresultStatus(r) == PGRES_PIPELINE_SYNC;
+        PQclear(r);
+        if (synced)  break;
+    }
+
+    if (PQstatus(_conn) != CONNECTION_OK  &&  ! _deferred_error  &&  ! _pipelined_sql.empty())
+        _deferred_error = std::make_pair(string(PQerrorMessage(_conn)), _pipelined_sql.back());
+    _pipelined_sql.clear();
+    note_transaction_status();
+#endif
+}
+
 void
 session_impl::throw_last_error() const {
     const char *const dbms_message = PQerrorMessage(_conn);
-    string message(dbms_message ? dbms_message : "");
-    const enum { deadlock, broken_connection, other } category =
+    throw_error(dbms_message ? dbms_message : "", _latest_sql);
+}
+
+void
+session_impl::throw_error(const string &dbms_message, const string &sql) const {
+    string message = dbms_message;
+    const enum { deadlock, broken_connection, timeout, other } category =
           message.find("ERROR:  deadlock detected") == 0?
             deadlock
         : message.find("ERROR:  could not serialize access due to concurrent update") == 0?
@@ -429,39 +1428,64 @@ session_impl::throw_last_error() const {
             broken_connection
         : message.find("no connection to the server") == 0?
             broken_connection
+        : message.find("ERROR:  canceling statement due to statement timeout") == 0?
+            timeout
+        : message.find("ERROR:  canceling statement due to user request") == 0  &&  _cancelled?
+            timeout
         :
             other;
-    message += " (most recent SQL command was `" + _latest_sql + "')";
+    message += " (most recent SQL command was `" + sql + "')";
 
     switch (category) {
         case deadlock:          throw deadlock_exception(message);
         case broken_connection: _database.discard_connections();
                                 throw broken_connection_exception(message);
+        case timeout:           throw statement_timeout_exception(message);
         default:                throw dbms_exception(message);
     }
 }
 
 void
 session_impl::check_no_output(PGresult *exec_result) {
+    trace_reporter reporter(*this);
     if (query_result(_database, exec_result).bad_no_data())  throw_last_error();
+    reporter.succeeded();
 }
 
 unique_ptr<row>
 session_impl::one_output(PGresult *exec_result) {
+    trace_reporter reporter(*this);
     query_result r(_database, exec_result);
     if (r.bad_data())  throw_last_error();
 
     unique_ptr<row> row = r.next();
     if (! r.at_end())  throw multi_row_exception();
 
+    reporter.succeeded();
     return row;
 }
 
+vector<unique_ptr<row>>
+session_impl::all_output(PGresult *exec_result) {
+    trace_reporter reporter(*this);
+    query_result r(_database, exec_result);
+    if (r.bad_data())  throw_last_error();
+
+    vector<unique_ptr<row>> result;
+    while (unique_ptr<row> row = r.next())
+        result.push_back(std::move(row));
+    reporter.succeeded();
+    return result;
+}
+
 vector<string>
 session_impl::metadata(PGresult *exec_result) {
-    const query_result r(_database, exec_result);
+    trace_reporter reporter(*this);
+    query_result r(_database, exec_result);
     if (r.bad_data())  throw_last_error();
-    return r.metadata();
+    const vector<string> result = r.metadata();
+    reporter.succeeded();
+    return result;
 }
 
 void
@@ -479,55 +1503,392 @@ session_impl::absorb_pending_results() {
 
 PGresult *
 session_impl::pq_exec(const sql &cmd) {
-    return exec_params(cmd.get_input().values()).exec(
-        _conn,
-        _latest_sql = cmd.get_text()
-    );
+    // Sending and then waiting, rather than PQexecParams(), so that tracing can tell the two apart.
+    //
+    const bool tracing = _tracing->enabled();
+    const clock_type::time_point start = tracing  ?  clock_type::now()  :  clock_type::time_point();
+
+    const exec_params params(cmd);
+    _latest_sql = cmd.get_text();
+    start_statement();
+
+    PGresult *result;
+    clock_type::time_point sent_at;
+    for (bool retrying = false; ; retrying = true) {
+        optional<string> statement_name;
+        if (const string *const cached = prepare(_latest_sql, params.n_params(), params.types()))
+            statement_name = *cached;
+        const int sent = statement_name
+            ?   params.send_prepared(_conn, *statement_name)
+            :   params.send(_conn, _latest_sql);
+
+        sent_at = tracing  ?  clock_type::now()  :  clock_type::time_point();
+        result = sent  ?  exec_finish()  :  nullptr;
+        if (! statement_name  ||  ! invalidates_prepared_statement(result))  break;
+
+        // The statement is gone from the server, or can't be used any more (e.g. because DDL
+        // from elsewhere changed its result type).  Outside a transaction nothing has been
+        // done yet, so we can prepare it afresh and try again, once.
+        //
+        forget_statement(*statement_name, result);
+        if (retrying  ||  ! outside_transaction())  break;
+        PQclear(result);
+        start_statement();
+    }
+    if (is_ddl(_latest_sql)) {
+        _database.forget_column_titles();
+        forget_all_statements();
+    }
+
+    note_transaction_status();
+
+    if (tracing) {
+        _decode_start = clock_type::now();
+        const ExecStatusType status = PQresultStatus(result);
+        _pending_trace = statement_trace{
+            _latest_sql,
+            static_cast<size_t>(params.n_params()),
+            std::chrono::duration_cast<std::chrono::nanoseconds>(sent_at - start),
+            std::chrono::duration_cast<std::chrono::nanoseconds>(_decode_start - sent_at),
+            std::chrono::nanoseconds(0),
+            status == PGRES_TUPLES_OK  ?  boost::numeric_cast<uint64_t>(PQntuples(result))  :  0,
+            result_bytes(result),
+            status == PGRES_COMMAND_OK  ||  status == PGRES_TUPLES_OK
+        };
+    }
+    return result;
+}
+
+PGresult *
+session_impl::exec_finish() {
+    // Like PQexec(), return the last result, unless there's an error, in which case return the
+    // first error.
+    //
+    PGresult *result = nullptr;
+    while (PGresult *const r = get_result()) {
+        const ExecStatusType status = PQresultStatus(r);
+        if (result  &&  PQresultStatus(result) == PGRES_FATAL_ERROR)
+            PQclear(r);
+        else {
+            PQclear(result);
+            result = r;
+        }
+        if (status == PGRES_COPY_IN  ||  status == PGRES_COPY_OUT  ||  status == PGRES_COPY_BOTH)  break;
+        if (PQstatus(_conn) == CONNECTION_BAD)  break;
+    }
+    return result;
+}
+
+PGresult *
+session_impl::get_result() {
+    const optional<clock_type::time_point> deadline = statement_deadline();
+    if (deadline  &&  ! _cancelled)
+        while (PQisBusy(_conn)) {
+            const clock_type::duration remaining = *deadline - clock_type::now();
+            if (remaining <= clock_type::duration::zero()) {
+                // If this fails (e.g. because the statement has just finished) then we just
+                // get the statement's real result.
+                //
+                if (PGcancel *const cancel = PQgetCancel(_conn)) {
+                    char error_buffer[256];
+                    PQcancel(cancel, error_buffer, sizeof(error_buffer));
+                    PQfreeCancel(cancel);
+                }
+                _cancelled = true;
+                break;
+            }
+
+            const auto remaining_ms = std::chrono::duration_cast<std::chrono::milliseconds>(remaining) + std::chrono::milliseconds(1);
+            vector<socket_poll_item> items(1, make_socket_poll_item(PQsocket(_conn), true, false));
+            if (poll_sockets(items, static_cast<int>(std::min<std::chrono::milliseconds::rep>(remaining_ms.count(), INT_MAX))) < 0
+                &&  errno != EINTR
+            )
+                break;  // PQgetResult() will report any problem
+            if (! PQconsumeInput(_conn))  break;
+        }
+    return PQgetResult(_conn);
+}
+
+optional<clock_type::time_point>
+session_impl::statement_deadline() const {
+    optional<clock_type::time_point> result = _deadline;
+    if (_statement_timeout != std::chrono::milliseconds::zero()) {
+        const clock_type::time_point timed_out = _statement_start + _statement_timeout;
+        if (! result  ||  timed_out < *result)  result = timed_out;
+    }
+    return result;
+}
+
+void
+session_impl::start_statement() {
+    _cancelled = false;
+    if (_statement_timeout != std::chrono::milliseconds::zero())  _statement_start = clock_type::now();
+}
+
+optional<clock_type::time_point>
+session_impl::set_deadline(const optional<clock_type::time_point> &deadline) {
+    const optional<clock_type::time_point> result = _deadline;
+    _deadline = deadline;
+    return result;
+}
+
+optional<clock_type::time_point>
+session_impl::deadline() const {
+    return _deadline;
+}
+
+bool
+session_impl::in_pipeline() const {
+#ifdef LIBPQ_HAS_PIPELINING
+    return PQpipelineStatus(_conn) != PQ_PIPELINE_OFF;
+#else
+    return false;
+#endif
+}
+
+bool
+session_impl::owns(const result_stream &rs) const {
+    const shared_ptr<stream_impl> rsi = dynamic_pointer_cast<stream_impl>(rs);
+    return rsi  &&  &rsi->owner() == this;
+}
+
+bool
+session_impl::outside_transaction() const {
+    return PQtransactionStatus(_conn) == PQTRANS_IDLE;
+}
+
+bool
+session_impl::in_transaction() const {
+    switch (PQtransactionStatus(_conn)) {
+        case PQTRANS_INTRANS:
+        case PQTRANS_INERROR:   return true;
+        default:                return false;
+    }
+}
+
+void
+session_impl::note_transaction_status() {
+    // Only called between commands, so the status is settled.
+    //
+    const bool now_in_transaction = in_transaction();
+    if (_was_in_transaction  &&  ! now_in_transaction)  _transaction_serial++;
+    _was_in_transaction = now_in_transaction;
 }
 
 int
 session_impl::pq_send(const sql &cmd) {
-    return exec_params(cmd.get_input().values()).send(
-        _conn,
-        _latest_sql = cmd.get_text()
+    const exec_params params(cmd);
+    _latest_sql = cmd.get_text();
+    start_statement();
+
+    const string *const statement_name = prepare(_latest_sql, params.n_params(), params.types());
+    const int result = statement_name
+        ?   params.send_prepared(_conn, *statement_name)
+        :   params.send(_conn, _latest_sql);
+    if (is_ddl(_latest_sql)) {
+        _database.forget_column_titles();
+        forget_all_statements();
+    }
+    return result;
+}
+
+const string *
+session_impl::prepare(const string &text, int n_params, const Oid *types) {
+    if (! _statement_cache->enabled())  return nullptr;
+
+    const string key = statement_cache::key(text, n_params, types);
+    if (const string *const found = _statement_cache->find(key))  return found;
+    if (in_pipeline() || _awaiting_async)  return nullptr;  // preparing would cost a round trip of its own
+
+    if (const optional<string> victim = _statement_cache->make_room())
+        _unwanted_statements.push_back(*victim);
+    deallocate_unwanted_statements();
+
+    const string statement_name = _statement_cache->next_name();
+    const query_result prepared(
+        _database,
+        PQsendPrepare(_conn, statement_name.c_str(), text.c_str(), n_params, types)  ?  exec_finish()  :  nullptr
+    );
+    if (prepared.bad_no_data())  throw_last_error();
+
+    return &_statement_cache->insert(key, statement_name);
+}
+
+void
+session_impl::forget_statement(const string &statement_name, const PGresult *failure) {
+    // After invalid_sql_statement_name there's nothing on the server to deallocate.
+    //
+    const char *const sqlstate = PQresultErrorField(failure, PG_DIAG_SQLSTATE);
+    if (_statement_cache->forget(statement_name)  &&  ! (sqlstate  &&  string(sqlstate) == "26000"))
+        _unwanted_statements.push_back(statement_name);
+}
+
+void
+session_impl::forget_all_statements() {
+    for (string &name: _statement_cache->clear())
+        _unwanted_statements.push_back(std::move(name));
+}
+
+void
+session_impl::deallocate_unwanted_statements() {
+    if (_unwanted_statements.empty())  return;
+
+    string text;
+    for (const string &name: _unwanted_statements) {
+        const unique_ptr<dialect_sql> deallocate = _database.make_dialect_sql();
+        deallocate->write_deallocate(name);
+        text += deallocate->get_text() + ";";
+    }
+    _unwanted_statements.clear();
+
+    // All in one round trip.  If this fails (e.g. because we're in an aborted transaction) then
+    // the remaining statements just linger on the server until the connection closes.
+    //
+    if (PQsendQuery(_conn, text.c_str()))  PQclear(exec_finish());
+}
+
+string
+session_impl::new_cursor_name() {
+    // Names are recycled, so that the DECLARE and FETCH commands for repeated queries are
+    // textually identical, and hence can share prepared statements.
+    //
+    if (_idle_cursor_names.empty())  return "cursor_" + to_string(_next_cursor_serial++);
+
+    const string result = _idle_cursor_names.back();
+    _idle_cursor_names.pop_back();
+    return result;
+}
+
+result_stream
+session_impl::exec_with_single_row_output(const sql &cmd, uint32_t fetch_size) {
+    if (! pq_send(cmd))  throw_last_error();
+#ifdef LIBPQ_HAS_CHUNK_MODE
+    const int mode_set = PQsetChunkedRowsMode(_conn, boost::numeric_cast<int>(fetch_size));
+#else
+    (void) fetch_size;
+    const int mode_set = PQsetSingleRowMode(_conn);
+#endif
+    assert(mode_set == 1);  // it can only fail if there's no query just sent
+    (void) mode_set;
+
+    const shared_ptr<single_row_stream_impl> result = std::make_shared<single_row_stream_impl>(
+        *this,
+        _database,
+        [this]                              { return get_result(); },
+        [this] (const string &message)      { throw_error(message, _latest_sql); }
     );
+    _asynchronous_stream = result;
+    return result;
 }
 
 result_stream
-session_impl::new_result_stream(const string &cursor_name, uint32_t fetch_size) {
+session_impl::new_result_stream(
+    const string &cursor_name,
+    uint32_t fetch_size,
+    optional<uint64_t> declaring_transaction
+) {
     assert(!_asynchronous_stream);
 
     _asynchronous_stream = quince::make_unique<result_stream_impl>(
+        *this,
         _database,
         cursor_name,
         _conn,
         fetch_size,
-        [this] (const sql &cmd) { return pq_send(cmd); },
-        [this, cursor_name]     { close_cursor(cursor_name); }
+        _stream_prefetch_depth,
+        _stream_memory_budget,
+        _tracing,
+        [this] (const sql &cmd)             { return pq_send(cmd); },
+        [this]                              { return get_result(); },
+        [this] (const string &message)      { throw_error(message, _latest_sql); },
+        [=]                                 { close_cursor(cursor_name, declaring_transaction); }
     );
     return _asynchronous_stream;
 }
 
 void
-session_impl::close_cursor(const string &cursor_name) {
+session_impl::close_cursor(const string &cursor_name, optional<uint64_t> declaring_transaction) {
+    absorb_pending_results();  // in case some other stream has a FETCH in flight
+    if (declaring_transaction) {
+        note_transaction_status();
+        if (*declaring_transaction != _transaction_serial) {
+            // The cursor ended with its transaction, and a CLOSE now would fail.
+            //
+            _idle_cursor_names.push_back(cursor_name);
+            return;
+        }
+        if (PQtransactionStatus(_conn) == PQTRANS_INERROR)
+            return;  // CLOSE would fail, but the cursor goes with the rollback
+    }
+
     const unique_ptr<dialect_sql> cmd = _database.make_dialect_sql();
     cmd->write_close_cursor(cursor_name);
     check_no_output(pq_exec(*cmd));
+    _idle_cursor_names.push_back(cursor_name);
 }
 
-PGconn *
-session_impl::connect(const session_impl::spec &spec) {
+vector<PGconn *>
+session_impl::connect(const session_impl::spec &spec, size_t n) {
     assert(! _disabled);
-    if (! _have_registered_disabler) {
-        // We might get here more than once, because of a race condition.  No harm done.
-        //
-        atexit(disable);
+    if (! _have_registered_disabler.exchange(true))
         // Avoid PQfinish() calls after exit(), because (a) there's no benefit and more
         // importantly (b) they can crash because the libpq might have shut down by then.
         //
-        _have_registered_disabler = false;
+        atexit(disable);
+
+    struct attempt {
+        PGconn *_conn;
+        PostgresPollingStatusType _status;
+    };
+    const string connection_string = spec.connection_string();
+    vector<attempt> attempts;
+    for (size_t i = 0; i < n; i++)
+        if (PGconn *const conn = PQconnectStart(connection_string.c_str())) {
+            if (PQstatus(conn) == CONNECTION_BAD)
+                PQfinish(conn);
+            else
+                attempts.push_back({ conn, PGRES_POLLING_WRITING });
+        }
+
+    // Attempts still pending at the deadline are abandoned.
+    //
+    const clock_type::time_point deadline = attempts.empty()
+        ?   clock_type::now()
+        :   clock_type::now() + connect_timeout(attempts.front()._conn);
+
+    vector<PGconn *> result;
+    while (! attempts.empty()) {
+        const clock_type::duration remaining = deadline - clock_type::now();
+        if (remaining <= clock_type::duration::zero())  break;
+
+        vector<socket_poll_item> items;
+        for (const attempt &a: attempts)
+            items.push_back(make_socket_poll_item(
+                PQsocket(a._conn),
+                a._status == PGRES_POLLING_READING,
+                a._status == PGRES_POLLING_WRITING
+            ));
+        const auto remaining_ms = std::chrono::duration_cast<std::chrono::milliseconds>(remaining) + std::chrono::milliseconds(1);
+        if (poll_sockets(items, static_cast<int>(std::min<std::chrono::milliseconds::rep>(remaining_ms.count(), INT_MAX))) < 0
+            &&  errno != EINTR
+        )
+            break;
+
+        vector<attempt> still_pending;
+        for (size_t i = 0; i < attempts.size(); i++) {
+            attempt a = attempts[i];
+            if (items[i].revents != 0)  a._status = PQconnectPoll(a._conn);
+
+            switch (a._status) {
+                case PGRES_POLLING_OK:      result.push_back(a._conn);      break;
+                case PGRES_POLLING_FAILED:  PQfinish(a._conn);              break;
+                default:                    still_pending.push_back(a);
+            }
+        }
+        attempts.swap(still_pending);
     }
-    return PQconnectdb(spec.connection_string().c_str());
+    for (const attempt &a: attempts)  PQfinish(a._conn);
+    return result;
 }
 
 void
@@ -540,7 +1901,7 @@ session_impl::disable() {
     _disabled = true;
 }
 
-bool session_impl::_disabled = false;  // I can rely on load-time initialization (i.e. before the static init sequence), because bool is a POD.
-bool session_impl::_have_registered_disabler = false;
+std::atomic<bool> session_impl::_disabled(false);  // I can rely on load-time initialization (i.e. before the static init sequence), because the constructor is constexpr.
+std::atomic<bool> session_impl::_have_registered_disabler(false);
 
 }
@@ -0,0 +1,51 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <assert.h>
+#include <exception>
+#include <future>
+#include <quince/detail/util.h>
+#include <quince_postgresql/sharded_database.h>
+
+using std::vector;
+
+
+namespace quince_postgresql {
+
+sharded_database::sharded_database(const vector<shard_spec> &shards) {
+    assert(! shards.empty());
+
+    for (const shard_spec &s: shards)
+        _shards.push_back(quince::make_unique<database>(
+            s._host,
+            s._user,
+            s._password,
+            s._db_name,
+            s._default_schema,
+            s._port
+        ));
+}
+
+sharded_database::~sharded_database()
+{}
+
+void
+sharded_database::for_each_shard(const std::function<void(size_t)> &work) const {
+    vector<std::future<void>> done;
+    for (size_t i = 0; i < _shards.size(); i++)
+        done.push_back(std::async(std::launch::async, work, i));
+
+    std::exception_ptr first_failure;
+    for (std::future<void> &d: done)
+        try {
+            d.get();
+        }
+        catch (...) {
+            if (! first_failure)  first_failure = std::current_exception();
+        }
+    if (first_failure)  std::rethrow_exception(first_failure);
+}
+
+}
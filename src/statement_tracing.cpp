@@ -0,0 +1,167 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include <sstream>
+#include <quince_postgresql/detail/statement_tracing.h>
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::vector;
+
+
+namespace quince_postgresql {
+
+namespace {
+    // Durations below sub_buckets microseconds get a bucket each.  Above that, each power of two
+    // is divided into sub_buckets buckets.
+    //
+    enum { sub_buckets = 8, sub_bucket_bits = 3, n_buckets = sub_buckets + (64 - sub_bucket_bits)*sub_buckets };
+
+    unsigned
+    highest_bit(uint64_t value) {
+        unsigned result = 0;
+        while (value >>= 1)  result++;
+        return result;
+    }
+}
+
+latency_histogram::latency_histogram() :
+    _counts(n_buckets, 0),
+    _count(0),
+    _total(0),
+    _max(0)
+{}
+
+void
+latency_histogram::record(std::chrono::nanoseconds duration) {
+    const microseconds us = std::max(duration_cast<microseconds>(duration), microseconds(0));
+    _counts[bucket_index(us.count())]++;
+    _count++;
+    _total += us;
+    _max = std::max(_max, us);
+}
+
+microseconds
+latency_histogram::percentile(double fraction) const {
+    if (_count == 0)  return microseconds(0);
+
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(fraction * _count + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < _counts.size(); i++) {
+        seen += _counts[i];
+        if (seen >= rank)  return std::min(microseconds(bucket_upper_bound(i)), _max);
+    }
+    return _max;
+}
+
+size_t
+latency_histogram::bucket_index(uint64_t us) {
+    if (us < sub_buckets)  return us;
+
+    const unsigned exponent = highest_bit(us);
+    const unsigned shift = exponent - sub_bucket_bits;
+    const size_t sub_bucket = (us >> shift) - sub_buckets;
+    return sub_buckets + shift*sub_buckets + sub_bucket;
+}
+
+uint64_t
+latency_histogram::bucket_upper_bound(size_t index) {
+    if (index < sub_buckets)  return index;
+
+    const unsigned shift = (index - sub_buckets) / sub_buckets;
+    const uint64_t sub_bucket = (index - sub_buckets) % sub_buckets;
+    return ((sub_buckets + sub_bucket + 1) << shift) - 1;
+}
+
+
+statement_tracing::statement_tracing() :
+    _enabled(false),
+    _histograms_enabled(false)
+{}
+
+void
+statement_tracing::set_observer(const statement_observer &observer) {
+    const lock_guard<mutex> lock(_settings_mutex);
+    std::shared_ptr<const statement_observer> replacement;
+    if (observer)  replacement = std::make_shared<const statement_observer>(observer);
+    std::atomic_store(&_observer, replacement);
+    update_enabled();
+}
+
+void
+statement_tracing::set_histograms_enabled(bool enabled) {
+    const lock_guard<mutex> lock(_settings_mutex);
+    _histograms_enabled.store(enabled, std::memory_order_relaxed);
+    update_enabled();
+}
+
+void
+statement_tracing::report(const statement_trace &trace) {
+    if (_histograms_enabled.load(std::memory_order_relaxed)) {
+        histogram_shard &shard = shard_for(trace._sql);
+        const lock_guard<mutex> lock(shard._mutex);
+        shard._histograms[trace._sql].record(trace._send_time + trace._wait_time + trace._decode_time);
+    }
+    // No lock held, so the observer can take its time, or even change the settings.
+    //
+    const std::shared_ptr<const statement_observer> observer = std::atomic_load(&_observer);
+    if (observer)  (*observer)(trace);
+}
+
+string
+statement_tracing::histograms_snapshot() const {
+    vector<std::pair<string, latency_histogram>> entries;
+    for (histogram_shard &shard: _shards) {
+        const lock_guard<mutex> lock(shard._mutex);
+        entries.insert(entries.end(), shard._histograms.begin(), shard._histograms.end());
+    }
+    std::sort(entries.begin(), entries.end(), [](
+        const std::pair<string, latency_histogram> &lhs,
+        const std::pair<string, latency_histogram> &rhs
+    ) {
+        return lhs.second.total() > rhs.second.total();
+    });
+
+    std::stringstream strm;
+    for (const auto &entry: entries) {
+        const latency_histogram &h = entry.second;
+        strm << "count=" << h.count()
+             << " total_us=" << h.total().count()
+             << " p50_us=" << h.percentile(0.5).count()
+             << " p90_us=" << h.percentile(0.9).count()
+             << " p99_us=" << h.percentile(0.99).count()
+             << " max_us=" << h.max().count()
+             << " sql=" << entry.first
+             << "\n";
+    }
+    return strm.str();
+}
+
+void
+statement_tracing::clear_histograms() {
+    for (histogram_shard &shard: _shards) {
+        const lock_guard<mutex> lock(shard._mutex);
+        shard._histograms.clear();
+    }
+}
+
+statement_tracing::histogram_shard &
+statement_tracing::shard_for(const string &sql) const {
+    return _shards[std::hash<string>()(sql) % n_shards];
+}
+
+void
+statement_tracing::update_enabled() {
+    _enabled.store(
+        std::atomic_load(&_observer) != nullptr  ||  _histograms_enabled.load(std::memory_order_relaxed),
+        std::memory_order_relaxed
+    );
+}
+
+}
@@ -0,0 +1,141 @@
+//          Copyright Michael Shepanski 2014.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file ../LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Tests of the backend's own features, against a PostgreSQL database.  Normally run by
+// run_bench.sh, which provides a throwaway database.
+//
+// Usage: quince-postgresql-test host user password db_name port
+
+#define BOOST_TEST_MODULE quince_postgresql
+#include <stdint.h>
+#include <stdlib.h>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <string>
+#include <vector>
+#include <boost/test/included/unit_test.hpp>
+#include <quince/quince.h>
+#include <quince_postgresql/database.h>
+#include <quince_postgresql/pipeline.h>
+
+using quince_postgresql::record_decoder;
+using quince_postgresql::statement_trace;
+using std::string;
+using std::vector;
+
+struct point {
+    int32_t id;
+    double x;
+};
+QUINCE_MAP_CLASS(point, (id)(x))
+
+
+namespace {
+    // The database named on the command line, shared by all the tests.
+    //
+    quince_postgresql::database &
+    test_db() {
+        const auto &suite = boost::unit_test::framework::master_test_suite();
+        if (suite.argc < 6) {
+            std::cerr << "usage: " << suite.argv[0] << " host user password db_name port" << std::endl;
+            exit(2);
+        }
+        static quince_postgresql::database db(suite.argv[1], suite.argv[2], suite.argv[3], suite.argv[4], "", suite.argv[5]);
+        return db;
+    }
+
+    template<typename Table>
+    void
+    recreate(Table &table) {
+        table.drop_if_exists();
+        table.open();
+    }
+
+    // Record the text of each statement executed while it exists.
+    //
+    class statement_recorder {
+    public:
+        explicit statement_recorder(quince_postgresql::database &db) :
+            _db(db)
+        {
+            _db.set_statement_observer([this](const statement_trace &trace) { _texts.push_back(trace._sql); });
+        }
+
+        ~statement_recorder() {
+            _db.set_statement_observer(nullptr);
+        }
+
+        const vector<string> &texts() const  { return _texts; }
+
+    private:
+        quince_postgresql::database &_db;
+        vector<string> _texts;
+    };
+}
+
+
+BOOST_AUTO_TEST_CASE(array_parameter_keeps_statement_text_fixed) {
+    quince_postgresql::database &db = test_db();
+    quince::table<point> points(db, "test_points", &point::id);
+    recreate(points);
+    for (int32_t i = 0; i < 10000; i++)  points.insert(point{ i, i * 0.5 });
+
+    const record_decoder<point, int32_t, double> decoder(&point::id, &point::x);
+    const string select = "SELECT id, x FROM test_points WHERE id = ANY($1) ORDER BY id";
+    const vector<int32_t> few = { 3, 1, 4 };
+    vector<int32_t> many(10000);
+    std::iota(many.begin(), many.end(), 0);
+
+    vector<point> few_found, many_found;
+    vector<string> texts;
+    {
+        const statement_recorder recorder(db);
+        few_found = db.fetch_all(decoder, select, few);
+        many_found = db.fetch_all(decoder, select, many);
+        texts = recorder.texts();
+    }
+
+    BOOST_REQUIRE_EQUAL(few_found.size(), 3u);
+    BOOST_CHECK_EQUAL(few_found[0].id, 1);
+    BOOST_CHECK_EQUAL(few_found[2].x, 2.0);
+    BOOST_CHECK_EQUAL(many_found.size(), 10000u);
+    BOOST_REQUIRE_EQUAL(texts.size(), 2u);
+    BOOST_CHECK_EQUAL(texts[0], texts[1]);
+}
+
+BOOST_AUTO_TEST_CASE(pipelined_failure_in_nested_transaction_spares_outer_transaction) {
+    quince_postgresql::database &db = test_db();
+    quince::table<point> points(db, "test_points", &point::id);
+    recreate(points);
+    {
+        quince::transaction outer(db);
+        points.insert(point{ 1, 1.0 });
+        {
+            quince::transaction nested(db);
+            const quince_postgresql::pipeline pipe(db);
+            points.insert(point{ 2, 2.0 });
+            points.insert(point{ 1, 3.0 });     // duplicate key, reported when the savepoint ends
+            BOOST_CHECK_THROW(nested.commit(), quince::exception);
+        }
+        points.insert(point{ 3, 3.0 });
+        outer.commit();
+    }
+
+    const record_decoder<point, int32_t, double> decoder(&point::id, &point::x);
+    const vector<point> found = db.fetch_all(decoder, "SELECT id, x FROM test_points ORDER BY id");
+    BOOST_REQUIRE_EQUAL(found.size(), 2u);
+    BOOST_CHECK_EQUAL(found[0].x, 1.0);
+    BOOST_CHECK_EQUAL(found[1].id, 3);
+}
+
+BOOST_AUTO_TEST_CASE(out_of_range_integer_is_malformed) {
+    const quince_postgresql::database &db = test_db();
+    const record_decoder<point, int32_t, double> decoder(&point::id, &point::x);
+    const int64_t too_big = int64_t(std::numeric_limits<int32_t>::max()) + 1;
+
+    BOOST_CHECK_EQUAL(db.fetch_one(decoder, "SELECT $1::int8, 0.5::float8", int64_t(7))->id, 7);
+    BOOST_CHECK_THROW(db.fetch_one(decoder, "SELECT $1::int8, 0.5::float8", too_big), quince::malformed_results_exception);
+}